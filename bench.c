@@ -0,0 +1,390 @@
+// Copyright 2014 Philip Puryear
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// sudoku-bench: times the solver on a set of corpora with each of its
+// engines, and prints the results as JSON.
+//
+// It links against the solver's internals, so that it can be timed a puzzle
+// at a time without going through the command line.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "solver.h"
+
+#ifndef SUDOKU_PUZZLE_DIR
+#define SUDOKU_PUZZLE_DIR "puzzles"
+#endif
+
+// A named set of puzzle files, found in the puzzle directory.
+typedef struct {
+    const char* name;
+    const char* files[3];
+} BenchCorpus;
+
+// An engine, along with the options that change how it searches.
+typedef struct {
+    const char* name;
+    Engine engine;
+    ColumnChooser chooser;
+} BenchSolver;
+
+typedef struct {
+    const char* name;
+    Puzzle* puzzles;
+    size_t num_puzzles;
+    int max_size;
+    // Set for the empty grids, which have far too many solutions to find
+    // them all.
+    bool empty;
+} BenchInput;
+
+typedef struct {
+    const char* puzzle_dir;
+    double min_time;
+    uint64_t max_solutions;
+    bool print_solutions;
+} BenchOptions;
+
+static const BenchCorpus kBenchCorpora[] = {
+    { "easy", { "easy.txt", "easy2.txt" } },
+    { "hard", { "hard.txt" } },
+    { "17-clue", { "17-clue.txt" } },
+    { "16x16", { "16x16.txt" } }
+};
+
+static const char* const kDefaultCorpora[] = {
+    "easy", "hard", "17-clue", "16x16", "empty-9", "empty-16", "empty-25"
+};
+
+static const BenchSolver kBenchSolvers[] = {
+    { "bitboard", ENGINE_BITBOARD, CHOOSER_SCAN },
+    { "dlx-scan", ENGINE_DLX, CHOOSER_SCAN },
+    { "dlx-buckets", ENGINE_DLX, CHOOSER_BUCKETS }
+};
+
+static const int kNumBenchSolvers =
+    sizeof(kBenchSolvers) / sizeof(kBenchSolvers[0]);
+
+static void add_puzzle(BenchInput* in, const Puzzle* p, Arena* arena) {
+    if ((in->num_puzzles & (in->num_puzzles - 1)) == 0) {
+        size_t n = in->num_puzzles ? 2 * in->num_puzzles : 16;
+        in->puzzles = realloc(in->puzzles, sizeof(Puzzle) * n);
+        if (!in->puzzles)
+            fatal("out of memory");
+    }
+    copy_puzzle(&in->puzzles[in->num_puzzles++], p, arena);
+    if (p->size > in->max_size)
+        in->max_size = p->size;
+}
+
+static void read_corpus_file(BenchInput* in, const char* path, Arena* arena) {
+    PuzzleReader r;
+    if (!open_reader(&r, path))
+        fatal("cannot open %s: %s", path, strerror(errno));
+    Puzzle p;
+    int ret;
+    while ((ret = read_puzzle(&p, &r, arena)) == 0)
+        add_puzzle(in, &p, arena);
+    if (ret < 0)
+        read_error(path, &r, true, in->num_puzzles);
+    close_reader(&r);
+}
+
+// Loads the corpus called name: one of kBenchCorpora, empty-N for an empty
+// NxN grid, or else the path of a puzzle file.
+static void load_corpus(BenchInput* in, const char* name,
+                        const BenchOptions* opts, Arena* arena) {
+    *in = (BenchInput) { .name = name };
+    if (strncmp(name, "empty-", 6) == 0) {
+        char* end;
+        long size = strtol(name + 6, &end, 10);
+        if (*end != '\0' || size < 1 || size > kMaxPuzzleSize ||
+            !issquare(size))
+            fatal("invalid puzzle size: %s", name + 6);
+        Puzzle p;
+        init_puzzle(&p, size, arena);
+        memset(p.cells[0], 0, sizeof(int) * p.num_cells);
+        add_puzzle(in, &p, arena);
+        in->empty = true;
+        return;
+    }
+    int n = sizeof(kBenchCorpora) / sizeof(kBenchCorpora[0]);
+    for (int i = 0; i < n; i++) {
+        if (strcmp(name, kBenchCorpora[i].name) != 0)
+            continue;
+        for (int j = 0; j < 3 && kBenchCorpora[i].files[j]; j++) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", opts->puzzle_dir,
+                     kBenchCorpora[i].files[j]);
+            read_corpus_file(in, path, arena);
+        }
+        return;
+    }
+    read_corpus_file(in, name, arena);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Returns the smallest of the n sorted values that at least fraction p of
+// them are no greater than.
+static double percentile(const double* sorted, size_t n, double p) {
+    size_t i = (size_t) ceil(p * n);
+    return sorted[i > 0 ? i - 1 : 0];
+}
+
+// Solves the corpus over and over for at least opts->min_time seconds, then
+// prints what was measured as a JSON object.
+static void run_bench(const BenchInput* in, const BenchSolver* solver,
+                      const BenchOptions* opts) {
+    ProgramConfig config = {
+        .print_solutions = opts->print_solutions,
+        .print_num_solutions = !opts->print_solutions,
+        .engine = solver->engine,
+        .chooser = solver->chooser,
+        .num_threads = 1,
+        .max_solutions = opts->max_solutions ? opts->max_solutions :
+                         in->empty ? 1 : UINT64_MAX,
+        .count = UINT64_MAX
+    };
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0)
+        fatal("cannot open /dev/null: %s", strerror(errno));
+    OutputBuffer out;
+    init_output(&out, null_fd);
+    SolverContext ctx;
+    init_solver(&ctx, &config);
+    ctx.out = &out;
+
+    // Build the matrices and bitboards ahead of time, so that the first
+    // puzzle of each size is not charged for them.
+    solve_puzzle(&ctx, &in->puzzles[0]);
+    reset_arena(&ctx.arena);
+
+    size_t num_samples = 0, max_samples = 0;
+    double* latencies = NULL;
+    uint64_t num_solutions = 0;
+    double start = monotonic_seconds(), elapsed;
+    do {
+        for (size_t i = 0; i < in->num_puzzles; i++) {
+            if (num_samples == max_samples) {
+                max_samples = max_samples ? 2 * max_samples : 1024;
+                latencies = realloc(latencies, sizeof(double) * max_samples);
+                if (!latencies)
+                    fatal("out of memory");
+            }
+            double t = monotonic_seconds();
+            num_solutions += solve_puzzle(&ctx, &in->puzzles[i]);
+            latencies[num_samples++] = monotonic_seconds() - t;
+            reset_arena(&ctx.arena);
+        }
+        elapsed = monotonic_seconds() - start;
+    } while (elapsed < opts->min_time);
+
+    // Counting the search nodes slows the search down a little, so they are
+    // counted in a pass of their own.
+    uint64_t num_nodes = 0, num_backtracks = 0;
+    config.stats = true;
+    for (size_t i = 0; i < in->num_puzzles; i++) {
+        solve_puzzle(&ctx, &in->puzzles[i]);
+        num_nodes += ctx.stats.nodes;
+        num_backtracks += ctx.stats.backtracks;
+        reset_arena(&ctx.arena);
+    }
+    flush_output(&out);
+
+    qsort(latencies, num_samples, sizeof(double), compare_doubles);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("  {\"corpus\": \"%s\", \"solver\": \"%s\", \"puzzles\": %zu, "
+           "\"passes\": %zu,\n", in->name, solver->name, in->num_puzzles,
+           num_samples / in->num_puzzles);
+    printf("   \"seconds\": %.6f, \"puzzles_per_sec\": %.1f, "
+           "\"solutions\": %" PRIu64 ",\n", elapsed, num_samples / elapsed,
+           num_solutions);
+    printf("   \"nodes_per_pass\": %" PRIu64 ", "
+           "\"backtracks_per_pass\": %" PRIu64 ",\n", num_nodes,
+           num_backtracks);
+    printf("   \"latency_us\": {\"min\": %.2f, \"p50\": %.2f, \"p90\": %.2f, "
+           "\"p99\": %.2f, \"max\": %.2f},\n", latencies[0] * 1e6,
+           percentile(latencies, num_samples, 0.5) * 1e6,
+           percentile(latencies, num_samples, 0.9) * 1e6,
+           percentile(latencies, num_samples, 0.99) * 1e6,
+           latencies[num_samples - 1] * 1e6);
+    // Linux gives ru_maxrss in kilobytes.
+    printf("   \"peak_rss_kb\": %ld}", usage.ru_maxrss);
+
+    free(latencies);
+    destroy_solver(&ctx);
+    free_output(&out);
+    close(null_fd);
+}
+
+static void print_bench_usage(void) {
+    printf(
+"usage: sudoku-bench [OPTIONS] [CORPUS]...\n"
+"\n"
+"Solves each CORPUS with each solver and prints the puzzles solved per\n"
+"second, the latency percentiles, the search nodes per pass and the peak\n"
+"resident memory of every run as a JSON array. A CORPUS is one of easy,\n"
+"hard, 17-clue or 16x16 from the puzzle directory, empty-N for an empty NxN\n"
+"grid, or the path of a puzzle file. By default, every named corpus is run,\n"
+"along with empty-9, empty-16 and empty-25.\n"
+"\n"
+"Options:\n"
+"  --solver=SOLVER\n"
+"        run only SOLVER (bitboard, dlx-scan or dlx-buckets); may be given\n"
+"        more than once. The bitboard solver skips corpora it cannot solve.\n"
+"  --min-time=SECONDS\n"
+"        solve each corpus repeatedly for at least SECONDS (by default 1)\n"
+"  --max-solutions=N\n"
+"        stop searching each puzzle once N solutions have been found (by\n"
+"        default, 1 for the empty grids and unlimited otherwise)\n"
+"  --puzzle-dir=DIR\n"
+"        find the named corpora in DIR (by default " SUDOKU_PUZZLE_DIR ")\n"
+"  -n    only count the solutions, rather than printing them to /dev/null\n"
+"  -h    show this message and exit\n");
+}
+
+int main(int argc, char** argv) {
+    BenchOptions opts = {
+        .puzzle_dir = SUDOKU_PUZZLE_DIR,
+        .min_time = 1,
+        .max_solutions = 0,
+        .print_solutions = true
+    };
+    bool use_solver[sizeof(kBenchSolvers) / sizeof(kBenchSolvers[0])] = {
+        false
+    };
+    bool any_solver = false;
+    static const struct option long_options[] = {
+        { "solver", required_argument, NULL, 's' },
+        { "min-time", required_argument, NULL, 't' },
+        { "max-solutions", required_argument, NULL, 'm' },
+        { "puzzle-dir", required_argument, NULL, 'd' },
+        { "number-only", no_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    for (;;) {
+        int c = getopt_long(argc, argv, "nh", long_options, NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 's': {
+            int i = 0;
+            while (i < kNumBenchSolvers &&
+                   strcmp(optarg, kBenchSolvers[i].name) != 0)
+                i++;
+            if (i == kNumBenchSolvers)
+                fatal("unknown solver: %s", optarg);
+            use_solver[i] = any_solver = true;
+            break;
+        }
+        case 't': {
+            char* end;
+            opts.min_time = strtod(optarg, &end);
+            if (*optarg == '\0' || *end != '\0' || !(opts.min_time >= 0))
+                fatal("invalid time: %s", optarg);
+            break;
+        }
+        case 'm':
+            opts.max_solutions = parse_count(optarg, 1,
+                                             "number of solutions");
+            break;
+        case 'd':
+            opts.puzzle_dir = optarg;
+            break;
+        case 'n':
+            opts.print_solutions = false;
+            break;
+        case 'h':
+            print_bench_usage();
+            return EXIT_SUCCESS;
+        default:
+            print_bench_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (!any_solver) {
+        for (int i = 0; i < kNumBenchSolvers; i++)
+            use_solver[i] = true;
+    }
+
+    const char* const* names = (const char* const*) argv + optind;
+    int num_corpora = argc - optind;
+    if (num_corpora == 0) {
+        names = kDefaultCorpora;
+        num_corpora = sizeof(kDefaultCorpora) / sizeof(kDefaultCorpora[0]);
+    }
+    Arena arena;
+    init_arena(&arena);
+    BenchInput* inputs = xmalloc(sizeof(BenchInput) * num_corpora);
+    for (int i = 0; i < num_corpora; i++) {
+        load_corpus(&inputs[i], names[i], &opts, &arena);
+        if (inputs[i].num_puzzles == 0)
+            fatal("corpus %s has no puzzles", names[i]);
+    }
+
+    // Each run gets a process of its own, so that its peak memory use is
+    // its own too.
+    printf("[");
+    bool first = true;
+    for (int i = 0; i < num_corpora; i++) {
+        for (int j = 0; j < kNumBenchSolvers; j++) {
+            if (!use_solver[j] ||
+                (kBenchSolvers[j].engine == ENGINE_BITBOARD &&
+                 inputs[i].max_size > kMaxBitboardSize))
+                continue;
+            printf(first ? "\n" : ",\n");
+            first = false;
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid < 0)
+                fatal("cannot fork: %s", strerror(errno));
+            if (pid == 0) {
+                run_bench(&inputs[i], &kBenchSolvers[j], &opts);
+                fflush(stdout);
+                _exit(EXIT_SUCCESS);
+            }
+            int status;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+                continue;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                fatal("%s with %s failed", inputs[i].name,
+                      kBenchSolvers[j].name);
+        }
+    }
+    printf("\n]\n");
+
+    for (int i = 0; i < num_corpora; i++)
+        free(inputs[i].puzzles);
+    free(inputs);
+    free_arena(&arena);
+    free_matrix_images();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+# Copyright 2014 Philip Puryear
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# The training run for the PGO build type: runs the instrumented solver,
+# SUDOKU, over every puzzle file in PUZZLE_DIR with each engine and chooser,
+# splits single puzzles up over two threads, and then solves puzzles made
+# with --generate, whose uniqueness checks are themselves dlx searches. The
+# seeds are fixed, so every build trains on the same puzzles.
+#
+#   cmake -DSUDOKU=path/to/sudoku -DPUZZLE_DIR=puzzles -P pgo-train.cmake
+
+if(NOT SUDOKU OR NOT PUZZLE_DIR)
+  message(FATAL_ERROR "SUDOKU and PUZZLE_DIR must be set")
+endif()
+
+# Runs the solver with the given arguments, or pipes the output of one run
+# into another where they are separated by THEN. A puzzle with no solutions
+# or several is no failure, but a crash is.
+function(train)
+  set(commands COMMAND ${SUDOKU})
+  foreach(arg ${ARGN})
+    if(arg STREQUAL "THEN")
+      list(APPEND commands COMMAND ${SUDOKU})
+    else()
+      list(APPEND commands ${arg})
+    endif()
+  endforeach()
+  execute_process(${commands} RESULT_VARIABLE result
+                  OUTPUT_QUIET ERROR_QUIET)
+  if(NOT result MATCHES "^[0-3]$")
+    message(FATAL_ERROR "training failed (${result}): sudoku ${ARGN}")
+  endif()
+endfunction()
+
+file(GLOB puzzle_files ${PUZZLE_DIR}/*.txt)
+foreach(file ${puzzle_files})
+  train(-b ${file})
+  train(-b -n ${file})
+  train(-b -n --engine=dlx ${file})
+  train(-b -n --engine=dlx --chooser=buckets ${file})
+endforeach()
+foreach(name hard indeterminate)
+  train(-j 2 -n ${PUZZLE_DIR}/${name}.txt)
+endforeach()
+
+train(--generate=9 --seed=1 --count=1000 -l THEN -b -n -)
+train(--generate=9 --seed=2 --count=200 -l -j 2
+      THEN -b -n --engine=dlx --chooser=buckets -)
+train(--generate=16 --seed=1 --count=3 -l THEN -b -n --engine=dlx -)
@@ -0,0 +1,3425 @@
+// Copyright 2014 Philip Puryear
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "solver.h"
+
+// How much output is buffered before it is written out.
+static const size_t kOutputFlushSize = 1 << 16;
+// The packed format starts with a header of kPackedHeaderSize bytes, laid out
+// as follows, with every field little-endian:
+//
+//   0  magic        "SDKP"
+//   4  version      uint16, kPackedVersion
+//   6  cell_bits    uint8, the number of bits in each cell
+//   7  (reserved)   uint8, 0
+//   8  size         uint16, the size of every puzzle in the file
+//  10  (reserved)   uint16, 0
+//  12  record_size  uint32, the number of bytes in each puzzle
+//  16  count        uint64, the number of puzzles, or UINT64_MAX to read
+//                   until the end of the file
+//  24  data_offset  uint64, where the first puzzle starts
+//
+// Puzzle i takes up the record_size bytes from data_offset + i * record_size,
+// so any puzzle can be found without an index. Its cells are packed in order
+// from the least significant bit of each byte up, with 0 for an empty cell.
+static const char kPackedMagic[4] = { 'S', 'D', 'K', 'P' };
+static const int kPackedVersion = 1;
+static const size_t kPackedHeaderSize = 32;
+static const char kCacheMagic[4] = { 'S', 'D', 'K', 'C' };
+static const int kCacheVersion = 1;
+static const size_t kCacheHeaderSize = 8;
+static const size_t kCacheRecordHeaderSize = 16;
+// Arena blocks are whole, aligned huge pages, so that the kernel can back
+// them with huge pages where it supports them.
+static const size_t kArenaBlockSize = 2 << 20;
+static const size_t kArenaAlignment = 64;
+// The number of padding elements at the end of the arrays read by the
+// vectorized bitboard scans, enough for one whole vector.
+static const int kBitboardPadding = 16;
+// The search checks whether it should stop once every this many nodes.
+static const int kPollNodes = 1024;
+
+void fatal(const char* msg, ...) {
+    va_list ap;
+    fprintf(stderr, "error: ");
+    va_start(ap, msg);
+    vfprintf(stderr, msg, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+void* xmalloc(size_t n) {
+    void* p = malloc(n);
+    if (!p)
+        fatal("out of memory");
+    return p;
+}
+
+static ArenaBlock* new_arena_block(size_t min_size) {
+    size_t size = (min_size + kArenaBlockSize - 1) & ~(kArenaBlockSize - 1);
+    // Map an extra block's worth so that the start can be aligned, then give
+    // back what is left over on either side.
+    char* p = mmap(NULL, size + kArenaBlockSize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        fatal("out of memory");
+    size_t skip = -(uintptr_t) p & (kArenaBlockSize - 1);
+    if (skip > 0)
+        munmap(p, skip);
+    munmap(p + skip + size, kArenaBlockSize - skip);
+    p += skip;
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+    ArenaBlock* b = (ArenaBlock*) p;
+    b->next = NULL;
+    b->size = size;
+    b->used = (sizeof(ArenaBlock) + kArenaAlignment - 1) &
+              ~(kArenaAlignment - 1);
+    return b;
+}
+
+void init_arena(Arena* a) {
+    a->blocks = NULL;
+}
+
+void* arena_alloc(Arena* a, size_t n) {
+    n = (n + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+    ArenaBlock* b = a->blocks;
+    if (!b || b->size - b->used < n) {
+        b = new_arena_block(n + kArenaAlignment);
+        b->next = a->blocks;
+        a->blocks = b;
+    }
+    void* p = (char*) b + b->used;
+    b->used += n;
+    return p;
+}
+
+static void free_arena_blocks(ArenaBlock* b) {
+    while (b) {
+        ArenaBlock* next = b->next;
+        munmap(b, b->size);
+        b = next;
+    }
+}
+
+// Frees everything allocated from a, keeping its memory for reuse.
+void reset_arena(Arena* a) {
+    ArenaBlock* b = a->blocks;
+    if (!b)
+        return;
+    if (b->next) {
+        // Swap the blocks for a single one big enough for all of them, so
+        // that the arena stops growing once it has seen its largest puzzle.
+        size_t total = 0;
+        for (ArenaBlock* i = b; i; i = i->next)
+            total += i->size;
+        free_arena_blocks(b);
+        b = a->blocks = new_arena_block(total);
+    }
+    b->used = (sizeof(ArenaBlock) + kArenaAlignment - 1) &
+              ~(kArenaAlignment - 1);
+}
+
+void free_arena(Arena* a) {
+    free_arena_blocks(a->blocks);
+    a->blocks = NULL;
+}
+
+// The number of bits in each cell of a packed puzzle, enough to hold the
+// values 0 through size.
+static inline int packed_cell_bits(int size) {
+    int bits = 1;
+    while ((1 << bits) <= size)
+        bits++;
+    return bits;
+}
+
+static inline size_t packed_record_size(int size) {
+    return ((size_t) size * size * packed_cell_bits(size) + 7) / 8;
+}
+
+void init_output(OutputBuffer* o, int fd) {
+    *o = (OutputBuffer) { .data = NULL, .len = 0, .size = 0, .fd = fd };
+}
+
+void flush_output(OutputBuffer* o) {
+    if (o->fd < 0)
+        return;
+    for (size_t done = 0; done < o->len;) {
+        ssize_t n = write(o->fd, o->data + done, o->len - done);
+        if (n < 0 && errno != EINTR)
+            fatal("cannot write output: %s", strerror(errno));
+        if (n > 0)
+            done += n;
+    }
+    o->len = 0;
+}
+
+void free_output(OutputBuffer* o) {
+    flush_output(o);
+    free(o->data);
+}
+
+// Returns where the next n bytes of output should go. Once they have been
+// written, commit_output() adds them to the buffer.
+char* reserve_output(OutputBuffer* o, size_t n) {
+    if (o->size - o->len < n) {
+        while (o->size - o->len < n)
+            o->size = o->size ? 2 * o->size : kOutputFlushSize + n;
+        o->data = realloc(o->data, o->size);
+        if (!o->data)
+            fatal("out of memory");
+    }
+    return o->data + o->len;
+}
+
+void commit_output(OutputBuffer* o, char* end) {
+    o->len = end - o->data;
+    if (o->fd >= 0 && o->len >= kOutputFlushSize)
+        flush_output(o);
+}
+
+void append_output(OutputBuffer* o, const char* s, size_t n) {
+    if (n == 0)
+        return;
+    char* p = reserve_output(o, n);
+    memcpy(p, s, n);
+    commit_output(o, p + n);
+}
+
+__attribute__((format(printf, 2, 3)))
+static void format_output(OutputBuffer* o, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char* p = reserve_output(o, n + 1);
+    va_start(ap, fmt);
+    vsnprintf(p, n + 1, fmt, ap);
+    va_end(ap);
+    commit_output(o, p + n);
+}
+
+// Writes value right-aligned in width characters at p, returning the end.
+static inline char* format_value(char* p, int value, int width) {
+    char* end = p + width;
+    char* q = end;
+    do {
+        *--q = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while (q > p)
+        *--q = ' ';
+    return end;
+}
+
+// Appends solution to out as a grid, with the boxes ruled off unless it is a
+// jigsaw puzzle. If highlight is set, the cells that are empty in init are
+// highlighted.
+static void print_puzzle(OutputBuffer* out, const Puzzle* solution,
+                         const Puzzle* init, bool highlight) {
+    static const char kHighlightStart[] = "\x1b[1;31m";
+    static const char kHighlightEnd[] = "\x1b[0m";
+    int size = solution->size;
+    // A jigsaw's regions cannot be ruled off, so it gets no rules at all.
+    int block_size = solution->regions ? size : sqrt(size);
+    int max_cell_width = size < 10 ? 1 : size < 100 ? 2 : 3;
+    // A bound on the length of each line in the grid.
+    size_t line_len = size * (max_cell_width + 1) + 3 * block_size + 2;
+    if (highlight)
+        line_len += size * (sizeof(kHighlightStart) + sizeof(kHighlightEnd));
+    char* p = reserve_output(out, line_len * (size + block_size));
+    for (int i = 0; i < size; i++) {
+        if (i > 0 && i % block_size == 0) {
+            for (int j = 0; j < block_size; j++) {
+                if (j > 0) {
+                    memcpy(p, "-|-", 3);
+                    p += 3;
+                }
+                int len = block_size * (1 + max_cell_width) - 1;
+                memset(p, '-', len);
+                p += len;
+            }
+            *p++ = '\n';
+        }
+
+        for (int j = 0; j < size; j++) {
+            if (j > 0) {
+                *p++ = ' ';
+                if (j % block_size == 0) {
+                    *p++ = '|';
+                    *p++ = ' ';
+                }
+            }
+
+            int value = solution->cells[i][j];
+            if (value == 0) {
+                *p++ = '.';
+            } else if (highlight && init->cells[i][j] == 0) {
+                memcpy(p, kHighlightStart, sizeof(kHighlightStart) - 1);
+                p += sizeof(kHighlightStart) - 1;
+                p = format_value(p, value, max_cell_width);
+                memcpy(p, kHighlightEnd, sizeof(kHighlightEnd) - 1);
+                p += sizeof(kHighlightEnd) - 1;
+            } else {
+                p = format_value(p, value, max_cell_width);
+            }
+        }
+        *p++ = '\n';
+    }
+    commit_output(out, p);
+}
+
+// Appends solution to out as a single line that read_puzzle() can read back
+// in: the compact format for 4x4 and 9x9 puzzles, or otherwise the size
+// followed by the value of each cell. A variant's fields come first, and a
+// jigsaw's map of its regions last.
+static void print_puzzle_line(OutputBuffer* out, const Puzzle* solution) {
+    int size = solution->size;
+    const int* cells = solution->cells[0];
+    const int* regions = solution->regions;
+    char* p = reserve_output(out, 4 * (solution->num_cells + 1) +
+                                  (regions ? 4 * solution->num_cells : 0) +
+                                  16);
+    if (solution->diagonal) {
+        memcpy(p, "diagonal ", 9);
+        p += 9;
+    }
+    if (regions) {
+        memcpy(p, "jigsaw ", 7);
+        p += 7;
+    }
+    if (size == 4 || size == 9) {
+        for (int i = 0; i < solution->num_cells; i++)
+            *p++ = cells[i] == 0 ? '.' : '0' + cells[i];
+    } else {
+        p = format_value(p, size, size < 10 ? 1 : size < 100 ? 2 : 3);
+        for (int i = 0; i < solution->num_cells; i++) {
+            *p++ = ' ';
+            if (cells[i] == 0)
+                *p++ = '.';
+            else
+                p = format_value(p, cells[i], cells[i] < 10 ? 1 :
+                                              cells[i] < 100 ? 2 : 3);
+        }
+    }
+    if (regions && (size == 4 || size == 9)) {
+        *p++ = ' ';
+        for (int i = 0; i < solution->num_cells; i++)
+            *p++ = '1' + regions[i];
+    } else if (regions) {
+        for (int i = 0; i < solution->num_cells; i++) {
+            *p++ = ' ';
+            p = format_value(p, regions[i] + 1, regions[i] < 9 ? 1 :
+                                                regions[i] < 99 ? 2 : 3);
+        }
+    }
+    *p++ = '\n';
+    commit_output(out, p);
+}
+
+// Appends solution to out as a packed record.
+static void print_puzzle_packed(OutputBuffer* out, const Puzzle* solution) {
+    int bits = packed_cell_bits(solution->size);
+    char* p = reserve_output(out, packed_record_size(solution->size));
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    for (int cell = 0; cell < solution->num_cells; cell++) {
+        acc |= (uint64_t) solution->cells[0][cell] << acc_bits;
+        acc_bits += bits;
+        while (acc_bits >= 8) {
+            *p++ = acc;
+            acc >>= 8;
+            acc_bits -= 8;
+        }
+    }
+    if (acc_bits > 0)
+        *p++ = acc;
+    commit_output(out, p);
+}
+
+// Called with each puzzle before it is solved. The first one's size goes in
+// the header, which is written out ahead of any solutions, and the rest must
+// match it.
+void start_packed_puzzle(PackedOutput* po, OutputBuffer* out, const Puzzle* p) {
+    if (is_variant(p))
+        fatal("packed output cannot hold variant puzzles");
+    if (po->size == p->size)
+        return;
+    if (po->size != 0)
+        fatal("packed output needs puzzles that are all the same size");
+    po->size = p->size;
+    off_t pos = lseek(out->fd, 0, SEEK_CUR);
+    po->header_pos = pos < 0 ? -1 : pos + (off_t) out->len;
+
+    char* h = reserve_output(out, kPackedHeaderSize);
+    memset(h, 0, kPackedHeaderSize);
+    memcpy(h, kPackedMagic, sizeof(kPackedMagic));
+    store_le(h + 4, kPackedVersion, 2);
+    store_le(h + 6, packed_cell_bits(p->size), 1);
+    store_le(h + 8, p->size, 2);
+    store_le(h + 12, packed_record_size(p->size), 4);
+    store_le(h + 16, UINT64_MAX, 8);
+    store_le(h + 24, kPackedHeaderSize, 8);
+    commit_output(out, h + kPackedHeaderSize);
+}
+
+// Flushes out and, if possible, fills in the header's count.
+void finish_packed_output(PackedOutput* po, OutputBuffer* out) {
+    flush_output(out);
+    if (po->size == 0 || po->header_pos < 0)
+        return;
+    off_t end = lseek(out->fd, 0, SEEK_CUR);
+    if (end < 0)
+        return;
+    uint64_t count = (end - po->header_pos - kPackedHeaderSize) /
+                     packed_record_size(po->size);
+    char buf[8];
+    store_le(buf, count, 8);
+    if (pwrite(out->fd, buf, 8, po->header_pos + 16) != 8)
+        fatal("cannot write output: %s", strerror(errno));
+}
+
+// Puzzles live in an arena, and are freed along with it.
+void init_puzzle(Puzzle* p, int size, Arena* arena) {
+    p->cells = arena_alloc(arena, sizeof(int*) * size);
+    int num_cells = size * size;
+    p->cells[0] = arena_alloc(arena, sizeof(int) * num_cells);
+    for (int i = 1; i < size; i++)
+        p->cells[i] = p->cells[i - 1] + size;
+    p->size = size;
+    p->num_cells = num_cells;
+    p->diagonal = false;
+    p->regions = NULL;
+}
+
+void copy_puzzle(Puzzle* a, const Puzzle* b, Arena* arena) {
+    init_puzzle(a, b->size, arena);
+    memcpy(a->cells[0], b->cells[0], sizeof(int) * b->num_cells);
+    a->diagonal = b->diagonal;
+    if (b->regions) {
+        a->regions = arena_alloc(arena, sizeof(int) * b->num_cells);
+        memcpy(a->regions, b->regions, sizeof(int) * b->num_cells);
+    }
+}
+
+// Returns the next of a sequence of random numbers, whose position is held
+// in *state (splitmix64).
+static inline uint64_t next_random(uint64_t* state) {
+    *state += 0x9e3779b97f4a7c15;
+    return mix_bits(*state);
+}
+
+// Sorts the n indices in idx by key, leaving ties in their original order.
+static void sort_by_key(int* idx, int n, const uint64_t* key) {
+    for (int i = 1; i < n; i++) {
+        int x = idx[i];
+        int j = i;
+        for (; j > 0 && key[idx[j - 1]] > key[x]; j--)
+            idx[j] = idx[j - 1];
+        idx[j] = x;
+    }
+}
+
+// Orders the rows of p (or its columns, if by_cols is set) into bands and then
+// into rows within each band, filling in order. The keys only depend on which
+// cells are filled in, and on nothing that a symmetry of the grid can change.
+static void order_lines(const Puzzle* p, bool by_cols, int* order,
+                        Arena* arena) {
+    int size = p->size;
+    int block_size = sqrt(size);
+    uint64_t* count = arena_alloc(arena, sizeof(uint64_t) * size);
+    uint64_t* cross_count = arena_alloc(arena, sizeof(uint64_t) * size);
+    uint64_t* key = arena_alloc(arena, sizeof(uint64_t) * size);
+    uint64_t* band_key = arena_alloc(arena, sizeof(uint64_t) * block_size);
+    memset(count, 0, sizeof(uint64_t) * size);
+    memset(cross_count, 0, sizeof(uint64_t) * size);
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            int v = by_cols ? p->cells[j][i] : p->cells[i][j];
+            count[i] += v != 0;
+            cross_count[j] += v != 0;
+        }
+    }
+    // Rows with the same number of givens are told apart by the columns
+    // that their givens are in.
+    for (int i = 0; i < size; i++) {
+        uint64_t sum = 0;
+        for (int j = 0; j < size; j++) {
+            int v = by_cols ? p->cells[j][i] : p->cells[i][j];
+            if (v != 0)
+                sum += mix_bits(cross_count[j]);
+        }
+        key[i] = count[i] << 48 | (sum & ((UINT64_C(1) << 48) - 1));
+    }
+
+    int bands[kMaxPuzzleSize];
+    for (int band = 0; band < block_size; band++) {
+        bands[band] = band;
+        band_key[band] = 0;
+        for (int i = band * block_size; i < (band + 1) * block_size; i++)
+            band_key[band] += mix_bits(key[i]);
+    }
+    sort_by_key(bands, block_size, band_key);
+    for (int k = 0; k < block_size; k++) {
+        int* lines = order + k * block_size;
+        for (int i = 0; i < block_size; i++)
+            lines[i] = bands[k] * block_size + i;
+        sort_by_key(lines, block_size, key);
+    }
+}
+
+// Returns cell (i, j) of p under the row and column order of t, before the
+// values are relabelled.
+static inline int transformed_value(const Puzzle* p, const PuzzleTransform* t,
+                                    int i, int j) {
+    return t->transpose ? p->cells[t->cols[j]][t->rows[i]] :
+                          p->cells[t->rows[i]][t->cols[j]];
+}
+
+// Fills in t for one orientation of p, and writes the canonical cells.
+static void canonicalize_orientation(const Puzzle* p, PuzzleTransform* t,
+                                     uint16_t* cells, Arena* arena) {
+    int size = p->size;
+    order_lines(p, t->transpose, t->rows, arena);
+    order_lines(p, !t->transpose, t->cols, arena);
+    // Number the values in the order they first appear, and then any that
+    // never do.
+    memset(t->values, 0, sizeof(int) * (size + 1));
+    int next = 1;
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            int v = transformed_value(p, t, i, j);
+            if (v != 0 && t->values[v] == 0)
+                t->values[v] = next++;
+            cells[i * size + j] = t->values[v];
+        }
+    }
+    for (int v = 1; v <= size; v++) {
+        if (t->values[v] == 0)
+            t->values[v] = next++;
+    }
+    for (int v = 0; v <= size; v++)
+        t->inverse[t->values[v]] = v;
+}
+
+// Maps p onto a canonical form under the symmetries that preserve a puzzle's
+// solutions: relabelling the values, permuting the bands, the stacks, the rows
+// within a band and the columns within a stack, and transposing. The form is
+// not complete, in that lines with the same invariants are left in their
+// original order, so some equivalent puzzles end up with different forms.
+// Fills in t and writes the canonical cells.
+static void canonicalize_puzzle(const Puzzle* p, PuzzleTransform* t,
+                                uint16_t* cells, Arena* arena) {
+    int size = p->size;
+    PuzzleTransform alt;
+    for (int k = 0; k < 2; k++) {
+        PuzzleTransform* u = k == 0 ? t : &alt;
+        u->rows = arena_alloc(arena, sizeof(int) * size);
+        u->cols = arena_alloc(arena, sizeof(int) * size);
+        u->values = arena_alloc(arena, sizeof(int) * (size + 1));
+        u->inverse = arena_alloc(arena, sizeof(int) * (size + 1));
+        u->transpose = k == 1;
+    }
+    uint16_t* alt_cells = arena_alloc(arena, sizeof(uint16_t) * p->num_cells);
+    canonicalize_orientation(p, t, cells, arena);
+    canonicalize_orientation(p, &alt, alt_cells, arena);
+    if (memcmp(alt_cells, cells, sizeof(uint16_t) * p->num_cells) < 0) {
+        *t = alt;
+        memcpy(cells, alt_cells, sizeof(uint16_t) * p->num_cells);
+    }
+}
+
+// Maps the cells of a solution to p onto the canonical form given by t.
+static void canonical_solution(const int* solution, int size,
+                               const PuzzleTransform* t, uint16_t* cells) {
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            int cell = t->transpose ? t->cols[j] * size + t->rows[i] :
+                                      t->rows[i] * size + t->cols[j];
+            cells[i * size + j] = t->values[solution[cell]];
+        }
+    }
+}
+
+// The reverse of canonical_solution().
+static void original_solution(const uint16_t* cells, int size,
+                              const PuzzleTransform* t, int* solution) {
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) {
+            int cell = t->transpose ? t->cols[j] * size + t->rows[i] :
+                                      t->rows[i] * size + t->cols[j];
+            solution[cell] = t->inverse[cells[i * size + j]];
+        }
+    }
+}
+
+static uint64_t hash_cells(const uint16_t* cells, int size) {
+    uint64_t h = mix_bits(size);
+    for (int i = 0; i < size * size; i++)
+        h = (h ^ cells[i]) * 0x100000001b3;
+    return mix_bits(h);
+}
+
+static inline size_t cache_entry_bytes(const CacheEntry* e) {
+    size_t num_cells = (size_t) e->size * e->size;
+    return sizeof(CacheEntry) +
+           sizeof(uint16_t) * num_cells * (e->has_solution ? 2 : 1);
+}
+
+void init_cache(ResultCache* c, size_t max_bytes) {
+    *c = (ResultCache) {
+        .num_buckets = 1024,
+        .max_bytes = max_bytes
+    };
+    pthread_mutex_init(&c->lock, NULL);
+    c->buckets = xmalloc(sizeof(CacheEntry*) * c->num_buckets);
+    memset(c->buckets, 0, sizeof(CacheEntry*) * c->num_buckets);
+    init_output(&c->log, -1);
+}
+
+static void unlink_cache_entry(ResultCache* c, CacheEntry* e) {
+    if (e->older)
+        e->older->newer = e->newer;
+    else
+        c->oldest = e->newer;
+    if (e->newer)
+        e->newer->older = e->older;
+    else
+        c->newest = e->older;
+}
+
+static void push_cache_entry(ResultCache* c, CacheEntry* e) {
+    e->newer = NULL;
+    e->older = c->newest;
+    if (c->newest)
+        c->newest->newer = e;
+    else
+        c->oldest = e;
+    c->newest = e;
+}
+
+// Finds the entry for the canonical puzzle cells, or returns NULL. The caller
+// must hold c->lock.
+static CacheEntry* find_cache_entry(ResultCache* c, uint64_t hash, int size,
+                                    const uint16_t* cells) {
+    CacheEntry* e = c->buckets[hash & (c->num_buckets - 1)];
+    for (; e; e = e->next) {
+        if (e->hash == hash && e->size == size &&
+            memcmp(e->cells, cells, sizeof(uint16_t) * size * size) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void remove_cache_entry(ResultCache* c, CacheEntry* e) {
+    CacheEntry** link = &c->buckets[e->hash & (c->num_buckets - 1)];
+    while (*link != e)
+        link = &(*link)->next;
+    *link = e->next;
+    unlink_cache_entry(c, e);
+    c->bytes -= cache_entry_bytes(e);
+    c->num_entries--;
+    free(e);
+}
+
+static void grow_cache_buckets(ResultCache* c) {
+    size_t num_buckets = 2 * c->num_buckets;
+    CacheEntry** buckets = xmalloc(sizeof(CacheEntry*) * num_buckets);
+    memset(buckets, 0, sizeof(CacheEntry*) * num_buckets);
+    for (size_t i = 0; i < c->num_buckets; i++) {
+        while (c->buckets[i]) {
+            CacheEntry* e = c->buckets[i];
+            c->buckets[i] = e->next;
+            e->next = buckets[e->hash & (num_buckets - 1)];
+            buckets[e->hash & (num_buckets - 1)] = e;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->num_buckets = num_buckets;
+}
+
+// Adds e to c as the most recently used entry, replacing any entry for the
+// same puzzle and dropping the least recently used to make room. The caller
+// must hold c->lock.
+static void insert_cache_entry(ResultCache* c, CacheEntry* e) {
+    CacheEntry* old = find_cache_entry(c, e->hash, e->size, e->cells);
+    if (old)
+        remove_cache_entry(c, old);
+    size_t bytes = cache_entry_bytes(e);
+    while (c->oldest && c->bytes + bytes > c->max_bytes)
+        remove_cache_entry(c, c->oldest);
+    if (bytes > c->max_bytes) {
+        free(e);
+        return;
+    }
+    if (c->num_entries >= c->num_buckets)
+        grow_cache_buckets(c);
+    CacheEntry** bucket = &c->buckets[e->hash & (c->num_buckets - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    push_cache_entry(c, e);
+    c->bytes += bytes;
+    c->num_entries++;
+}
+
+// Appends e to out as a record of a cache file: the size, flags and number
+// of solutions, followed by the cells as 16-bit values. All are little-endian.
+static void write_cache_entry(OutputBuffer* out, const CacheEntry* e) {
+    size_t num_cells = (size_t) e->size * e->size;
+    size_t n = kCacheRecordHeaderSize +
+               2 * num_cells * (e->has_solution ? 2 : 1);
+    char* p = reserve_output(out, n);
+    memset(p, 0, kCacheRecordHeaderSize);
+    store_le(p, e->size, 2);
+    store_le(p + 2, e->complete | e->has_solution << 1, 1);
+    store_le(p + 8, e->num_solutions, 8);
+    for (size_t i = 0; i < n - kCacheRecordHeaderSize; i += 2)
+        store_le(p + kCacheRecordHeaderSize + i, e->cells[i / 2], 2);
+    commit_output(out, p + n);
+}
+
+static CacheEntry* new_cache_entry(int size, bool has_solution) {
+    size_t num_cells = (size_t) size * size;
+    CacheEntry* e = xmalloc(sizeof(CacheEntry) +
+                            sizeof(uint16_t) * num_cells *
+                            (has_solution ? 2 : 1));
+    e->size = size;
+    e->has_solution = has_solution;
+    return e;
+}
+
+// Reads all of the file at path, which is open as fd, then closes it.
+// Returns the contents, and their length in *len.
+char* read_whole_file(int fd, const char* path, size_t* len) {
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        fatal("cannot read %s: %s", path, strerror(errno));
+    *len = st.st_size;
+    char* data = xmalloc(*len + 1);
+    for (size_t done = 0; done < *len;) {
+        ssize_t n = read(fd, data + done, *len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            fatal("cannot read %s: %s", path,
+                  n < 0 ? strerror(errno) : "file truncated");
+        done += n;
+    }
+    close(fd);
+    return data;
+}
+
+// Reads the entries in the cache file at path into c, if it exists, then
+// rewrites the file with just the entries that were kept and opens it for
+// the entries still to come.
+void load_cache(ResultCache* c, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 && errno != ENOENT)
+        fatal("cannot open %s: %s", path, strerror(errno));
+    if (fd >= 0) {
+        size_t len;
+        char* data = read_whole_file(fd, path, &len);
+        if (len < kCacheHeaderSize ||
+            memcmp(data, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+            load_le(data + 4, 4) != (uint64_t) kCacheVersion)
+            fatal("%s is not a cache file", path);
+
+        // A record cut short, say by the program being killed while writing
+        // it, ends the file.
+        for (size_t pos = kCacheHeaderSize;
+             len - pos >= kCacheRecordHeaderSize;) {
+            const char* p = data + pos;
+            int size = load_le(p, 2);
+            int flags = load_le(p + 2, 1);
+            size_t num_cells = (size_t) size * size;
+            size_t n = kCacheRecordHeaderSize +
+                       2 * num_cells * (flags & 2 ? 2 : 1);
+            if (size < 1 || size > kMaxPuzzleSize || !issquare(size))
+                fatal("%s is corrupt", path);
+            if (len - pos < n)
+                break;
+            CacheEntry* e = new_cache_entry(size, flags & 2);
+            e->complete = flags & 1;
+            e->num_solutions = load_le(p + 8, 8);
+            for (size_t i = 0; i < n - kCacheRecordHeaderSize; i += 2) {
+                e->cells[i / 2] = load_le(p + kCacheRecordHeaderSize + i, 2);
+                if (e->cells[i / 2] > size)
+                    fatal("%s is corrupt", path);
+            }
+            e->hash = hash_cells(e->cells, size);
+            insert_cache_entry(c, e);
+            pos += n;
+        }
+        free(data);
+    }
+
+    // Write the new file alongside the old one so that a failure part way
+    // through leaves the old one intact.
+    size_t path_len = strlen(path);
+    char* tmp_path = xmalloc(path_len + 5);
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        fatal("cannot create %s: %s", tmp_path, strerror(errno));
+    init_output(&c->log, fd);
+    char* h = reserve_output(&c->log, kCacheHeaderSize);
+    memcpy(h, kCacheMagic, sizeof(kCacheMagic));
+    store_le(h + 4, kCacheVersion, 4);
+    commit_output(&c->log, h + kCacheHeaderSize);
+    for (CacheEntry* e = c->oldest; e; e = e->newer)
+        write_cache_entry(&c->log, e);
+    flush_output(&c->log);
+    if (rename(tmp_path, path) < 0)
+        fatal("cannot rename %s: %s", tmp_path, strerror(errno));
+    free(tmp_path);
+}
+
+// Writes out the entries added since the last call, if c has a file.
+void flush_cache(ResultCache* c) {
+    pthread_mutex_lock(&c->lock);
+    flush_output(&c->log);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void free_cache(ResultCache* c) {
+    free_output(&c->log);
+    if (c->log.fd >= 0)
+        close(c->log.fd);
+    while (c->oldest)
+        remove_cache_entry(c, c->oldest);
+    free(c->buckets);
+    pthread_mutex_destroy(&c->lock);
+}
+
+// Opens path for reading puzzles, with - meaning standard input. Returns
+// false and sets errno on failure.
+bool open_reader(PuzzleReader* r, const char* path) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    *r = (PuzzleReader) { .fd = fd };
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            r->buf = p;
+            r->len = st.st_size;
+            r->eof = true;
+            return true;
+        }
+    }
+    r->buf_size = kReadBlockSize;
+    r->buf = xmalloc(r->buf_size);
+    return true;
+}
+
+void close_reader(PuzzleReader* r) {
+    if (r->buf_size == 0)
+        munmap(r->buf, r->len);
+    else
+        free(r->buf);
+    if (r->fd != STDIN_FILENO)
+        close(r->fd);
+}
+
+// Reads in another block of input, keeping whatever is still unread.
+// Returns false at the end of the input or on error.
+static bool refill_reader(PuzzleReader* r) {
+    if (r->eof)
+        return false;
+    size_t unread = r->len - r->pos;
+    memmove(r->buf, r->buf + r->pos, unread);
+    r->pos = 0;
+    r->len = unread;
+    // Make room if a single field fills the whole buffer.
+    if (r->len == r->buf_size) {
+        r->buf_size *= 2;
+        r->buf = realloc(r->buf, r->buf_size);
+        if (!r->buf)
+            fatal("out of memory");
+    }
+    ssize_t n;
+    do {
+        n = read(r->fd, r->buf + r->len, r->buf_size - r->len);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        r->eof = true;
+        if (n < 0)
+            r->error = errno;
+        return false;
+    }
+    r->len += n;
+    return true;
+}
+
+// Makes sure that at least n bytes of input are in r's buffer, if there are
+// that many left.
+static bool fill_reader(PuzzleReader* r, size_t n) {
+    while (r->len - r->pos < n) {
+        if (!refill_reader(r))
+            return false;
+    }
+    return true;
+}
+
+static inline bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Skips any whitespace, then returns the next field, which is *len bytes
+// long and points into r's buffer. Returns NULL at the end of the input.
+static const char* next_field(PuzzleReader* r, size_t* len) {
+    for (;;) {
+        while (r->pos < r->len && is_space(r->buf[r->pos]))
+            r->pos++;
+        if (r->pos < r->len)
+            break;
+        if (!refill_reader(r))
+            return NULL;
+    }
+    size_t end = r->pos;
+    for (;;) {
+        while (end < r->len && !is_space(r->buf[end]))
+            end++;
+        // A field that runs to the end of the buffer may carry on in the
+        // next block.
+        if (end < r->len)
+            break;
+        // Refilling moves what is unread to the start of the buffer, even
+        // if there is nothing more to read.
+        size_t done = end - r->pos;
+        bool more = refill_reader(r);
+        end = r->pos + done;
+        if (!more)
+            break;
+    }
+    const char* field = r->buf + r->pos;
+    *len = end - r->pos;
+    r->pos = end;
+    return field;
+}
+
+// Returns true if nothing but whitespace is left in r, or for packed input,
+// if there are no puzzles left.
+bool at_end_of_input(PuzzleReader* r) {
+    if (r->packed_size > 0)
+        return r->packed_left == 0 || !fill_reader(r, 1);
+    size_t len;
+    if (next_field(r, &len) == NULL)
+        return true;
+    r->pos -= len;
+    return false;
+}
+
+// Checks whether r holds packed puzzles, and if so reads the header. Returns
+// false if the header is invalid.
+static bool start_reader(PuzzleReader* r) {
+    r->started = true;
+    if (!fill_reader(r, sizeof(kPackedMagic)) ||
+        memcmp(r->buf + r->pos, kPackedMagic, sizeof(kPackedMagic)) != 0)
+        return true;
+    if (!fill_reader(r, kPackedHeaderSize))
+        return false;
+    const char* h = r->buf + r->pos;
+    int size = load_le(h + 8, 2);
+    uint64_t data_offset = load_le(h + 24, 8);
+    if (load_le(h + 4, 2) != (uint64_t) kPackedVersion || size < 1 ||
+        size > kMaxPuzzleSize || !issquare(size) ||
+        load_le(h + 6, 1) != (uint64_t) packed_cell_bits(size) ||
+        load_le(h + 12, 4) != packed_record_size(size) ||
+        data_offset < kPackedHeaderSize || data_offset > (1 << 20))
+        return false;
+    r->packed_size = size;
+    r->packed_left = load_le(h + 16, 8);
+    if (!fill_reader(r, data_offset))
+        return false;
+    r->pos += data_offset;
+    return true;
+}
+
+static int read_packed_puzzle(Puzzle* puzzle, PuzzleReader* r,
+                              Arena* arena) {
+    int size = r->packed_size;
+    size_t record_size = packed_record_size(size);
+    if (r->packed_left == 0)
+        return 1;
+    if (!fill_reader(r, record_size)) {
+        // Without a count, the puzzles run to the end of the input.
+        bool at_end = r->pos == r->len && r->packed_left == UINT64_MAX;
+        return at_end && !r->error ? 1 : -1;
+    }
+    if (r->packed_left != UINT64_MAX)
+        r->packed_left--;
+
+    init_puzzle(puzzle, size, arena);
+    const uint8_t* p = (const uint8_t*) r->buf + r->pos;
+    r->pos += record_size;
+    int bits = packed_cell_bits(size);
+    uint32_t mask = (1u << bits) - 1;
+    uint64_t acc = 0;
+    int acc_bits = 0;
+    for (int cell = 0; cell < puzzle->num_cells; cell++) {
+        while (acc_bits < bits) {
+            acc |= (uint64_t) *p++ << acc_bits;
+            acc_bits += 8;
+        }
+        int value = acc & mask;
+        acc >>= bits;
+        acc_bits -= bits;
+        if (value > size)
+            return -1;
+        puzzle->cells[0][cell] = value;
+    }
+    return 0;
+}
+
+// Parses a field of 1 to 3 decimal digits, returning -1 if it is anything
+// else.
+static inline int parse_number(const char* field, size_t len) {
+    if (len > 3)
+        return -1;
+    int n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned digit = field[i] - '0';
+        if (digit > 9)
+            return -1;
+        n = 10 * n + digit;
+    }
+    return n;
+}
+
+// Parses a puzzle written as a single field of size * size characters: 1-9
+// for the given values, and . or 0 for empty cells.
+static int read_compact_puzzle(Puzzle* puzzle, const char* field, size_t len,
+                               Arena* arena) {
+    int size = len == 16 ? 4 : 9;
+    init_puzzle(puzzle, size, arena);
+    for (int cell = 0; cell < puzzle->num_cells; cell++) {
+        unsigned value = field[cell] == '.' ? 0 : field[cell] - '0';
+        if (value > (unsigned) size)
+            return -1;
+        puzzle->cells[0][cell] = value;
+    }
+    return 0;
+}
+
+static inline bool field_is(const char* field, size_t len, const char* s) {
+    return len == strlen(s) && memcmp(field, s, len) == 0;
+}
+
+// Reads the map of jigsaw puzzle p's regions from r: a number from 1 to
+// p->size for each cell, or for a 4x4 or 9x9 puzzle, a single field of those
+// digits. Each region must have p->size cells. Returns 0 on success or -1 on
+// error.
+static int read_regions(Puzzle* p, PuzzleReader* r, Arena* arena) {
+    p->regions = arena_alloc(arena, sizeof(int) * p->num_cells);
+    int cell = 0;
+    while (cell < p->num_cells) {
+        size_t len;
+        const char* field = next_field(r, &len);
+        if (!field)
+            return -1;
+        if (cell == 0 && (p->size == 4 || p->size == 9) &&
+            len == (size_t) p->num_cells) {
+            for (; cell < p->num_cells; cell++) {
+                unsigned region = field[cell] - '0';
+                if (region < 1 || region > (unsigned) p->size)
+                    return -1;
+                p->regions[cell] = region;
+            }
+            break;
+        }
+        int region = parse_number(field, len);
+        if (region < 1 || region > p->size)
+            return -1;
+        p->regions[cell++] = region;
+    }
+    int* region_size = arena_alloc(arena, sizeof(int) * p->size);
+    memset(region_size, 0, sizeof(int) * p->size);
+    for (int i = 0; i < p->num_cells; i++)
+        region_size[--p->regions[i]]++;
+    for (int i = 0; i < p->size; i++) {
+        if (region_size[i] != p->size)
+            return -1;
+    }
+    return 0;
+}
+
+// Reads the next puzzle from r. Returns 0 on success, 1 if the input ends
+// before the start of another puzzle, or -1 on error.
+//
+// A puzzle starts with its size, followed by the value of each cell: a
+// number, or . for an empty cell. All fields are separated by whitespace,
+// and fields made up only of - and | are ignored, so print_puzzle()'s output
+// can be read back in. A 4x4 or 9x9 puzzle can instead be written as one
+// field of 16 or 81 characters, as accepted by read_compact_puzzle().
+// Input in the packed format is recognised by its header.
+//
+// A variant puzzle is marked by fields before its size: "diagonal" if each
+// main diagonal must also hold every value once, and "jigsaw" if the boxes
+// are replaced by the regions whose map follows the cells (see
+// read_regions()).
+int read_puzzle(Puzzle* puzzle, PuzzleReader* r, Arena* arena) {
+    if (!r->started && !start_reader(r))
+        return -1;
+    if (r->packed_size > 0)
+        return read_packed_puzzle(puzzle, r, arena);
+    bool diagonal = false, jigsaw = false;
+    size_t len;
+    const char* field;
+    for (;;) {
+        field = next_field(r, &len);
+        if (!field)
+            return r->error || diagonal || jigsaw ? -1 : 1;
+        if (field_is(field, len, "diagonal"))
+            diagonal = true;
+        else if (field_is(field, len, "jigsaw"))
+            jigsaw = true;
+        else
+            break;
+    }
+    if (len == 16 || len == 81) {
+        if (read_compact_puzzle(puzzle, field, len, arena) < 0)
+            return -1;
+    } else {
+        int size = parse_number(field, len);
+        if (size < 1 || size > kMaxPuzzleSize || !issquare(size))
+            return -1;
+        init_puzzle(puzzle, size, arena);
+        int cell = 0;
+        while (cell < puzzle->num_cells) {
+            field = next_field(r, &len);
+            if (!field)
+                return -1;
+            int value;
+            if (len == 1 && field[0] == '.') {
+                value = 0;
+            } else {
+                value = parse_number(field, len);
+                if (value < 0) {
+                    for (size_t i = 0; i < len; i++) {
+                        if (field[i] != '-' && field[i] != '|')
+                            return -1;
+                    }
+                    continue;
+                }
+                if (value < 1 || value > size)
+                    return -1;
+            }
+            puzzle->cells[0][cell] = value;
+            cell++;
+        }
+    }
+    puzzle->diagonal = diagonal;
+    return jigsaw ? read_regions(puzzle, r, arena) : 0;
+}
+
+// Skips over the next n puzzles in r. Returns as for read_puzzle() on
+// hitting the end of the input or an error.
+int skip_puzzles(PuzzleReader* r, uint64_t n) {
+    if (!r->started && !start_reader(r))
+        return -1;
+    // Packed puzzles in a mapped file can be skipped over all at once.
+    if (r->packed_size > 0 && r->buf_size == 0) {
+        size_t record_size = packed_record_size(r->packed_size);
+        uint64_t available = (r->len - r->pos) / record_size;
+        if (available > r->packed_left)
+            available = r->packed_left;
+        if (n > available)
+            n = available;
+        r->pos += n * record_size;
+        if (r->packed_left != UINT64_MAX)
+            r->packed_left -= n;
+        return 0;
+    }
+    Arena arena;
+    init_arena(&arena);
+    int ret = 0;
+    for (uint64_t i = 0; i < n && ret == 0; i++) {
+        Puzzle p;
+        ret = read_puzzle(&p, r, &arena);
+        reset_arena(&arena);
+    }
+    free_arena(&arena);
+    return ret < 0 ? -1 : 0;
+}
+
+static void cover_column(DLXMatrix* m, DLXNode c) {
+    DLXNode *left = m->left, *right = m->right, *up = m->up, *down = m->down;
+    DLXNode* column = m->column;
+    int* row_count = m->row_count;
+    left[right[c]] = left[c];
+    right[left[c]] = right[c];
+    for (DLXNode i = down[c]; i != c; i = down[i]) {
+        for (DLXNode j = right[i]; j != i; j = right[j]) {
+            up[down[j]] = up[j];
+            down[up[j]] = down[j];
+            row_count[column[j]]--;
+        }
+    }
+}
+
+static void uncover_column(DLXMatrix* m, DLXNode c) {
+    DLXNode *left = m->left, *right = m->right, *up = m->up, *down = m->down;
+    DLXNode* column = m->column;
+    int* row_count = m->row_count;
+    for (DLXNode i = up[c]; i != c; i = up[i]) {
+        for (DLXNode j = left[i]; j != i; j = left[j]) {
+            row_count[column[j]]++;
+            up[down[j]] = j;
+            down[up[j]] = j;
+        }
+    }
+    left[right[c]] = c;
+    right[left[c]] = c;
+}
+
+// Covers every column of the row containing r, starting with r's own.
+void cover_row(DLXMatrix* m, DLXNode r) {
+    cover_column(m, m->column[r]);
+    for (DLXNode j = m->right[r]; j != r; j = m->right[j])
+        cover_column(m, m->column[j]);
+}
+
+// Undoes cover_row(m, r).
+void uncover_row(DLXMatrix* m, DLXNode r) {
+    for (DLXNode j = m->left[r]; j != r; j = m->left[j])
+        uncover_column(m, m->column[j]);
+    uncover_column(m, m->column[r]);
+}
+
+// Unlinks the row containing r from its columns, without covering them, so
+// that the search cannot choose it.
+static void hide_row(DLXMatrix* m, DLXNode r) {
+    DLXNode j = r;
+    do {
+        m->up[m->down[j]] = m->up[j];
+        m->down[m->up[j]] = m->down[j];
+        m->row_count[m->column[j]]--;
+        j = m->right[j];
+    } while (j != r);
+}
+
+// Undoes hide_row(m, r).
+static void unhide_row(DLXMatrix* m, DLXNode r) {
+    DLXNode j = r;
+    do {
+        m->row_count[m->column[j]]++;
+        m->up[m->down[j]] = j;
+        m->down[m->up[j]] = j;
+        j = m->right[j];
+    } while (j != r);
+}
+
+static inline bool is_column_covered(DLXMatrix* m, DLXNode c) {
+    return m->right[m->left[c]] != c;
+}
+
+// Looks up name in the hash table of the first num_columns of names, which
+// has table_size (a power of 2) slots, each holding -1 or an index into
+// names. Returns the slot where it is, or where it would go.
+static size_t find_column_name(char* const* names, const int* table,
+                               size_t table_size, const char* name) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (const char* p = name; *p; p++)
+        hash = (hash ^ (unsigned char) *p) * UINT64_C(1099511628211);
+    size_t i = hash & (table_size - 1);
+    while (table[i] >= 0 && strcmp(names[table[i]], name) != 0)
+        i = (i + 1) & (table_size - 1);
+    return i;
+}
+
+// Reads the exact cover problem in the file at path (or from standard input,
+// if path is -) into m, as the pristine matrix for it. The first line that is
+// not blank names the columns, with any after a | of their own being
+// secondary. Each later line is a row, listing the columns that it has a 1
+// in, or a comment if it starts with |. Since that is also how a header with
+// only secondary columns starts, the header itself is never a comment.
+void read_cover_matrix(DLXMatrix* m, const char* path) {
+    FILE* f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f)
+        fatal("cannot open %s: %s", path, strerror(errno));
+    char** names = NULL;
+    int num_columns = 0, max_columns = 0, num_primary = -1;
+    int* table = NULL;
+    size_t table_size = 0;
+    // The column of each of the 1s, row by row, and where each row starts.
+    DLXNode* entries = NULL;
+    size_t num_entries = 0, max_entries = 0;
+    size_t* row_ends = NULL;
+    int num_rows = 0, max_rows = 0;
+    // The last row to use each column, to catch a row that uses one twice.
+    int* last_row = NULL;
+
+    char* line = NULL;
+    size_t line_size = 0;
+    for (int line_num = 1; getline(&line, &line_size, f) >= 0; line_num++) {
+        char* save;
+        char* word = strtok_r(line, " \t\r\n", &save);
+        if (!word || (table && word[0] == '|'))
+            continue;
+        if (!table) {
+            // The column names.
+            for (; word; word = strtok_r(NULL, " \t\r\n", &save)) {
+                if (strcmp(word, "|") == 0) {
+                    if (num_primary >= 0)
+                        fatal("%s:%d: more than one |", path, line_num);
+                    num_primary = num_columns;
+                    continue;
+                }
+                if (num_columns == max_columns) {
+                    max_columns = max_columns ? 2 * max_columns : 64;
+                    names = realloc(names, sizeof(char*) * max_columns);
+                    if (!names)
+                        fatal("out of memory");
+                }
+                names[num_columns] = strdup(word);
+                if (!names[num_columns])
+                    fatal("out of memory");
+                num_columns++;
+            }
+            if (num_primary < 0)
+                num_primary = num_columns;
+            table_size = 16;
+            while (table_size < 2 * (size_t) num_columns)
+                table_size *= 2;
+            table = xmalloc(sizeof(int) * table_size);
+            memset(table, -1, sizeof(int) * table_size);
+            for (int i = 0; i < num_columns; i++) {
+                size_t slot = find_column_name(names, table, table_size,
+                                               names[i]);
+                if (table[slot] >= 0)
+                    fatal("%s:%d: column %s is named twice", path, line_num,
+                          names[i]);
+                table[slot] = i;
+            }
+            last_row = xmalloc(sizeof(int) * (num_columns + 1));
+            memset(last_row, -1, sizeof(int) * (num_columns + 1));
+            continue;
+        }
+
+        // A row.
+        for (; word; word = strtok_r(NULL, " \t\r\n", &save)) {
+            int i = table[find_column_name(names, table, table_size, word)];
+            if (i < 0)
+                fatal("%s:%d: unknown column %s", path, line_num, word);
+            if (last_row[i] == num_rows)
+                fatal("%s:%d: column %s is used twice", path, line_num,
+                      word);
+            last_row[i] = num_rows;
+            if (num_entries == max_entries) {
+                max_entries = max_entries ? 2 * max_entries : 1024;
+                entries = realloc(entries, sizeof(DLXNode) * max_entries);
+                if (!entries)
+                    fatal("out of memory");
+            }
+            entries[num_entries++] = 1 + i;
+        }
+        if (num_rows == max_rows) {
+            max_rows = max_rows ? 2 * max_rows : 1024;
+            row_ends = realloc(row_ends, sizeof(size_t) * max_rows);
+            if (!row_ends)
+                fatal("out of memory");
+        }
+        row_ends[num_rows++] = num_entries;
+    }
+    if (ferror(f))
+        fatal("cannot read %s: %s", path, strerror(errno));
+    if (f != stdin)
+        fclose(f);
+    free(line);
+    if (!table)
+        fatal("%s has no column names", path);
+    if (num_entries >= UINT32_MAX - (uint64_t) num_columns)
+        fatal("%s is too large", path);
+
+    // Lay the nodes out as for a puzzle: the root, the column headers, and
+    // then the rows, with each column's nodes in the order of the rows.
+    size_t num_nodes = 1 + num_columns + num_entries;
+    DLXNode* nodes = xmalloc(sizeof(DLXNode) * 5 * num_nodes);
+    DLXNode *left = nodes, *right = nodes + num_nodes,
+            *up = nodes + 2 * num_nodes, *down = nodes + 3 * num_nodes,
+            *column = nodes + 4 * num_nodes;
+    int* row_count = xmalloc(sizeof(int) * (num_columns + 1));
+    DLXNode* row_start = xmalloc(sizeof(DLXNode) * (num_rows + 1));
+    for (DLXNode c = 0; c <= (DLXNode) num_columns; c++) {
+        // Secondary columns are left out of the root's list.
+        bool linked = c <= (DLXNode) num_primary;
+        left[c] = !linked ? c : c == 0 ? (DLXNode) num_primary : c - 1;
+        right[c] = !linked ? c : c == (DLXNode) num_primary ? 0 : c + 1;
+        up[c] = down[c] = column[c] = c;
+        row_count[c] = 0;
+    }
+    DLXNode node = num_columns + 1;
+    for (int r = 0; r < num_rows; r++) {
+        row_start[r] = node;
+        size_t start = r ? row_ends[r - 1] : 0;
+        for (size_t i = start; i < row_ends[r]; i++, node++) {
+            DLXNode c = entries[i];
+            left[node] = i == start ? node + (row_ends[r] - start) - 1 :
+                                      node - 1;
+            right[node] = i + 1 == row_ends[r] ? row_start[r] : node + 1;
+            column[node] = c;
+            up[node] = up[c];
+            down[node] = c;
+            down[up[c]] = node;
+            up[c] = node;
+            row_count[c]++;
+        }
+    }
+    row_start[num_rows] = node;
+    int max_row_count = 0;
+    for (int c = 1; c <= num_columns; c++) {
+        if (row_count[c] > max_row_count)
+            max_row_count = row_count[c];
+    }
+
+    for (int i = 0; i < num_columns; i++)
+        free(names[i]);
+    free(names);
+    free(table);
+    free(last_row);
+    free(entries);
+    free(row_ends);
+    *m = (DLXMatrix) {
+        .size = 0,
+        .num_columns = num_columns,
+        .num_primary = num_primary,
+        .max_row_count = max_row_count,
+        // Each row of a solution covers a primary column of its own.
+        .max_depth = num_primary > 0 ? num_primary : 1,
+        .num_nodes = num_nodes,
+        .left = left,
+        .right = right,
+        .up = up,
+        .down = down,
+        .column = column,
+        .row_count = row_count,
+        .first_row = num_columns + 1,
+        .row_start = row_start,
+        .num_rows = num_rows,
+        .image = NULL,
+        .next = NULL
+    };
+}
+
+// Frees a pristine matrix built by read_cover_matrix() or
+// init_matrix_image().
+void free_matrix_image(DLXMatrix* m) {
+    free((int*) m->row_choices);
+    free((DLXNode*) m->row_start);
+    free(m->row_count);
+    free(m->left);
+}
+
+// Returns whether row r is still linked in, which it is only if none of its
+// columns have been covered.
+bool is_row_free(DLXMatrix* m, DLXNode r) {
+    DLXNode n = r;
+    do {
+        if (is_column_covered(m, m->column[n]))
+            return false;
+        n = m->right[n];
+    } while (n != r);
+    return true;
+}
+
+// Returns the first column with the fewest rows, or the root if every column
+// is covered. No column may have fewer than floor rows, so the scan stops at
+// the first with that many.
+static inline DLXNode choose_column(DLXMatrix* m, int floor) {
+    DLXNode c = 0;
+    int min_row_count = m->max_row_count + 1;
+    for (DLXNode j = m->right[0]; j != 0; j = m->right[j]) {
+        int row_count = m->row_count[j];
+        if (row_count < min_row_count) {
+            c = j;
+            min_row_count = row_count;
+            if (row_count <= floor)
+                break;
+        }
+    }
+    return c;
+}
+
+static inline void add_to_bucket(DLXMatrix* m, DLXNode c, int row_count) {
+    int w = c / 64;
+    m->bucket_bits[row_count * m->bucket_words + w] |= UINT64_C(1) << c % 64;
+    m->bucket_summary[row_count * m->summary_words + w / 64] |=
+        UINT64_C(1) << w % 64;
+}
+
+static inline void remove_from_bucket(DLXMatrix* m, DLXNode c,
+                                      int row_count) {
+    int w = c / 64;
+    uint64_t* word = &m->bucket_bits[row_count * m->bucket_words + w];
+    *word &= ~(UINT64_C(1) << c % 64);
+    if (*word == 0)
+        m->bucket_summary[row_count * m->summary_words + w / 64] &=
+            ~(UINT64_C(1) << w % 64);
+}
+
+// Puts each uncovered column into the bucket for its number of rows.
+static void fill_buckets(DLXMatrix* m) {
+    memset(m->bucket_bits, 0,
+           sizeof(uint64_t) * (m->max_row_count + 1) * m->bucket_words);
+    memset(m->bucket_summary, 0,
+           sizeof(uint64_t) * (m->max_row_count + 1) * m->summary_words);
+    for (DLXNode j = m->right[0]; j != 0; j = m->right[j])
+        add_to_bucket(m, j, m->row_count[j]);
+}
+
+// Returns the first column in the lowest bucket that has any, or the root if
+// every column is covered. No column may have fewer than floor rows.
+static inline DLXNode choose_column_from_buckets(DLXMatrix* m, int floor) {
+    for (int k = floor; k <= m->max_row_count; k++) {
+        const uint64_t* summary = m->bucket_summary + k * m->summary_words;
+        for (int i = 0; i < m->summary_words; i++) {
+            if (summary[i] == 0)
+                continue;
+            int w = i * 64 + __builtin_ctzll(summary[i]);
+            uint64_t word = m->bucket_bits[k * m->bucket_words + w];
+            return w * 64 + __builtin_ctzll(word);
+        }
+    }
+    return 0;
+}
+
+// The versions of cover_column() and uncover_column() used by the search.
+// Covering adds each primary column left with at most one row to
+// m->pending, and if indexed is set, both keep m's buckets of primary columns
+// up to date. The cover also counts itself in stats unless it is NULL. They
+// are inlined with a constant indexed and stats, so the searches without
+// buckets or --stats pay nothing for them.
+static inline __attribute__((always_inline))
+void search_cover_column(DLXMatrix* m, DLXNode c, bool indexed,
+                         SolverStats* stats) {
+    DLXNode *left = m->left, *right = m->right, *up = m->up, *down = m->down;
+    DLXNode* column = m->column;
+    int* row_count = m->row_count;
+    left[right[c]] = left[c];
+    right[left[c]] = right[c];
+    if (indexed && c <= (DLXNode) m->num_primary)
+        remove_from_bucket(m, c, row_count[c]);
+    if (stats) {
+        stats->covers++;
+        stats->links += 2;
+    }
+    for (DLXNode i = down[c]; i != c; i = down[i]) {
+        for (DLXNode j = right[i]; j != i; j = right[j]) {
+            up[down[j]] = up[j];
+            down[up[j]] = down[j];
+            if (stats)
+                stats->links += 2;
+            DLXNode col = column[j];
+            int n = --row_count[col];
+            bool primary = col <= (DLXNode) m->num_primary;
+            if (n <= 1 && primary)
+                m->pending[m->num_pending++] = col;
+            if (indexed && primary) {
+                remove_from_bucket(m, col, n + 1);
+                add_to_bucket(m, col, n);
+            }
+        }
+    }
+}
+
+static inline __attribute__((always_inline))
+void search_uncover_column(DLXMatrix* m, DLXNode c, bool indexed) {
+    DLXNode *left = m->left, *right = m->right, *up = m->up, *down = m->down;
+    DLXNode* column = m->column;
+    int* row_count = m->row_count;
+    for (DLXNode i = up[c]; i != c; i = up[i]) {
+        for (DLXNode j = left[i]; j != i; j = left[j]) {
+            DLXNode col = column[j];
+            int n = ++row_count[col];
+            if (indexed && col <= (DLXNode) m->num_primary) {
+                remove_from_bucket(m, col, n - 1);
+                add_to_bucket(m, col, n);
+            }
+            up[down[j]] = j;
+            down[up[j]] = j;
+        }
+    }
+    left[right[c]] = c;
+    right[left[c]] = c;
+    if (indexed && c <= (DLXNode) m->num_primary)
+        add_to_bucket(m, c, row_count[c]);
+}
+
+// Returns the index of the row of m that contains node r, for a matrix whose
+// rows are found through row_start.
+static int find_row(const DLXMatrix* m, DLXNode r) {
+    int lo = 0, hi = m->num_rows - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (m->row_start[mid] <= r)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// Returns the first node of the row of puzzle matrix m for choice i.
+static inline DLXNode choice_row(const DLXMatrix* m, int i) {
+    return m->row_start ? m->row_start[i] : m->first_row + 4 * i;
+}
+
+// Records the value chosen by row r in the solution puzzle.
+static inline void record_choice(SolverContext* ctx, DLXNode r) {
+    const DLXMatrix* m = ctx->matrix;
+    int size = m->size;
+    int choice = m->row_choices ? m->row_choices[find_row(m, r)] :
+                 m->row_start ? find_row(m, r) :
+                 (int) ((r - m->first_row) / 4);
+    int cell = choice / size;
+    ctx->solution->cells[0][cell] = choice % size + 1;
+}
+
+// Called by each engine when ctx->solution holds a new solution. The engines
+// check ctx->stop after each branch of the search, and unwind if it is set.
+static void report_solution(SolverContext* ctx) {
+    uint64_t max_solutions = ctx->config->max_solutions;
+    if (ctx->shared_solutions) {
+        uint64_t n = __atomic_fetch_add(ctx->shared_solutions, 1,
+                                        __ATOMIC_RELAXED);
+        // Another worker may have found the last one needed first.
+        if (n >= max_solutions) {
+            ctx->stop = true;
+            return;
+        }
+        if (n + 1 == max_solutions)
+            ctx->stop = true;
+    }
+
+    if (ctx->first_solution && ctx->num_solutions == 0)
+        memcpy(ctx->first_solution, ctx->solution->cells[0],
+               sizeof(int) * ctx->solution->num_cells);
+    ctx->num_solutions++;
+    if (ctx->callback) {
+        const int* cells = ctx->cover_rows ? ctx->cover_rows :
+                                             ctx->solution->cells[0];
+        if (ctx->callback(ctx->callback_data, cells))
+            ctx->stop = true;
+    }
+    if (ctx->num_solutions == max_solutions)
+        ctx->stop = true;
+}
+
+// The default callback, which prints the solution (the context's, whose
+// cells are cells) to the context's output.
+static int print_solution(void* data, const int* cells) {
+    (void) cells;
+    SolverContext* ctx = data;
+    const ProgramConfig* config = ctx->config;
+    if (config->packed) {
+        print_puzzle_packed(ctx->out, ctx->solution);
+    } else if (config->one_line) {
+        print_puzzle_line(ctx->out, ctx->solution);
+    } else {
+        if (ctx->num_solutions > 1)
+            append_output(ctx->out, "\n", 1);
+        print_puzzle(ctx->out, ctx->solution, ctx->init, config->highlight);
+    }
+    return 0;
+}
+
+double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Called by the engines every kPollNodes nodes. Returns true, having made the
+// search unwind, if the deadline has passed or the search has been
+// cancelled.
+__attribute__((noinline, cold)) bool poll_budget(SolverContext* ctx) {
+    ctx->poll_countdown = kPollNodes;
+    if ((ctx->cancel && *ctx->cancel) ||
+        (ctx->deadline > 0 && monotonic_seconds() >= ctx->deadline)) {
+        ctx->interrupted = true;
+        ctx->stop = true;
+    }
+    return ctx->interrupted;
+}
+
+// Saves dlx_search()'s position in ctx->checkpoint when it is interrupted
+// at the given depth, with row r still to be tried.
+static __attribute__((noinline, cold))
+void save_position(SolverContext* ctx, int depth, DLXNode r) {
+    DLXMatrix* m = ctx->matrix;
+    DLXPosition* pos = ctx->checkpoint;
+    pos->path = xmalloc(sizeof(uint32_t) * (depth + 1));
+    for (int i = 0; i < depth; i++)
+        pos->path[i] = m->stack[i] - m->first_row;
+    pos->path[depth] = r - m->first_row;
+    pos->path_len = depth + 1;
+    pos->num_solutions = ctx->num_solutions;
+}
+
+// Records row r in ctx's solution.
+static void record_row(SolverContext* ctx, DLXNode r) {
+    if (ctx->cover_rows)
+        ctx->cover_rows[ctx->num_cover_rows++] =
+            find_row(ctx->matrix, r) + 1;
+    else
+        record_choice(ctx, r);
+}
+
+// Reports the solution that the dlx search has reached, which is made up of
+// ctx->base_rows, the rows in the first num_chosen levels of
+// ctx->matrix->stack and those in its forced list. The search does not write
+// its choices to ctx->solution as it makes them, so they are filled in here,
+// if anything will look at them.
+static void report_dlx_solution(SolverContext* ctx, int num_chosen) {
+    if (ctx->callback || ctx->first_solution) {
+        DLXMatrix* m = ctx->matrix;
+        ctx->num_cover_rows = 0;
+        for (int i = 0; i < ctx->num_base_rows; i++)
+            record_row(ctx, ctx->base_rows[i]);
+        for (int i = 0; i < num_chosen; i++)
+            record_row(ctx, m->stack[i]);
+        for (int i = 0; i < m->num_forced; i++)
+            record_row(ctx, m->forced[i]);
+    }
+    report_solution(ctx);
+}
+
+static int compare_ints(const void* a, const void* b) {
+    int x = *(const int*) a, y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+// The default callback for --exact-cover, which prints the numbers of the
+// solution's rows (rows, which are the context's) in order on one line.
+static int print_cover_solution(void* data, const int* rows) {
+    (void) rows;
+    SolverContext* ctx = data;
+    qsort(ctx->cover_rows, ctx->num_cover_rows, sizeof(int), compare_ints);
+    for (int i = 0; i < ctx->num_cover_rows; i++)
+        format_output(ctx->out, i > 0 ? " %d" : "%d", ctx->cover_rows[i]);
+    append_output(ctx->out, "\n", 1);
+    return 0;
+}
+
+// Makes the forced moves: for each column in ctx->matrix->pending from
+// index i on that is left with just one row, covers that row and adds it to
+// m->forced. Those rows may force more in turn. Returns false if some column
+// is left with no rows at all, in which case there are no solutions.
+static inline __attribute__((always_inline))
+bool dlx_propagate(SolverContext* ctx, int i, bool indexed,
+                   SolverStats* stats) {
+    DLXMatrix* m = ctx->matrix;
+    for (; i < m->num_pending; i++) {
+        DLXNode c = m->pending[i];
+        if (is_column_covered(m, c))
+            continue;
+        if (m->row_count[c] == 0)
+            return false;
+        DLXNode r = m->down[c];
+        search_cover_column(m, c, indexed, stats);
+        for (DLXNode j = m->right[r]; j != r; j = m->right[j])
+            search_cover_column(m, m->column[j], indexed, stats);
+        m->forced[m->num_forced++] = r;
+    }
+    return true;
+}
+
+// Undoes the forced moves after the first num_forced.
+static inline __attribute__((always_inline))
+void undo_forced(DLXMatrix* m, int num_forced, bool indexed) {
+    while (m->num_forced > num_forced) {
+        DLXNode r = m->forced[--m->num_forced];
+        for (DLXNode j = m->left[r]; j != r; j = m->left[j])
+            search_uncover_column(m, m->column[j], indexed);
+        search_uncover_column(m, m->column[r], indexed);
+    }
+}
+
+// Takes dlx_search() back down the path in ctx->resume, the way that it went
+// the first time, up to the last row of the path. Returns the depth of that
+// row, which is left in m->stack[depth] to be tried next.
+static int resume_search(SolverContext* ctx, bool indexed) {
+    DLXMatrix* m = ctx->matrix;
+    const DLXPosition* pos = ctx->resume;
+    for (int depth = 0;; depth++) {
+        // A pruned matrix may have fewer nodes than the offsets allow for.
+        if (pos->path[depth] >= m->num_nodes - m->first_row)
+            fatal("the checkpoint does not match the puzzle");
+        DLXNode r = m->first_row + pos->path[depth];
+        DLXNode c = m->column[r];
+        if (!is_row_free(m, r))
+            fatal("the checkpoint does not match the puzzle");
+        DLXLevel* level = &m->levels[depth];
+        level->scan_start = m->num_pending;
+        search_cover_column(m, c, indexed, NULL);
+        level->num_pending = m->num_pending;
+        m->stack[depth] = r;
+        if (depth == pos->path_len - 1)
+            return depth;
+
+        level->num_forced = m->num_forced;
+        for (DLXNode j = m->right[r]; j != r; j = m->right[j])
+            search_cover_column(m, m->column[j], indexed, NULL);
+        if (!dlx_propagate(ctx, level->scan_start, indexed, NULL) ||
+            m->right[0] == 0)
+            fatal("the checkpoint does not match the puzzle");
+    }
+}
+
+// Searches from the current state of ctx->matrix, which must have no forced
+// moves left to make, leaving it as it was found. The search keeps its own
+// stack rather than recursing, since it can go one level deep for every cell
+// of the puzzle. indexed says whether to choose columns from buckets, and
+// stats is where to count what the search does, or NULL.
+static inline __attribute__((always_inline))
+void dlx_search(SolverContext* ctx, bool indexed, SolverStats* stats) {
+    DLXMatrix* m = ctx->matrix;
+    DLXLevel* levels = m->levels;
+    if (indexed)
+        fill_buckets(m);
+    int depth = 0;
+    DLXNode c, r;
+    if (ctx->resume) {
+        depth = resume_search(ctx, indexed);
+        r = m->stack[depth];
+        c = m->column[r];
+    } else {
+        // With the forced moves made, every column has at least two rows.
+        c = indexed ? choose_column_from_buckets(m, 2) : choose_column(m, 2);
+        levels[0].scan_start = m->num_pending;
+        search_cover_column(m, c, indexed, stats);
+        levels[0].num_pending = m->num_pending;
+        r = m->down[c];
+    }
+    for (;;) {
+        if (r == c) {
+            // Every row in column c has been tried, so go back up a level.
+            search_uncover_column(m, c, indexed);
+            if (depth == 0)
+                return;
+            r = m->stack[--depth];
+            c = m->column[r];
+        } else if (--ctx->poll_countdown == 0 && poll_budget(ctx)) {
+            // Out of time, so note that row r is next and unwind from here.
+            if (ctx->checkpoint)
+                save_position(ctx, depth, r);
+            r = c;
+            continue;
+        } else {
+            if (stats) {
+                stats->nodes++;
+                if (depth + 1 > stats->max_depth)
+                    stats->max_depth = depth + 1;
+            }
+            DLXLevel* level = &levels[depth];
+            m->num_pending = level->num_pending;
+            level->num_forced = m->num_forced;
+            for (DLXNode j = m->right[r]; j != r; j = m->right[j])
+                search_cover_column(m, m->column[j], indexed, stats);
+            if (dlx_propagate(ctx, level->scan_start, indexed, stats)) {
+                if (m->right[0] != 0) {
+                    // Go down a level.
+                    m->stack[depth++] = r;
+                    c = indexed ? choose_column_from_buckets(m, 2) :
+                                  choose_column(m, 2);
+                    levels[depth].scan_start = m->num_pending;
+                    search_cover_column(m, c, indexed, stats);
+                    levels[depth].num_pending = m->num_pending;
+                    r = m->down[c];
+                    continue;
+                }
+                // Found a solution.
+                m->stack[depth] = r;
+                report_dlx_solution(ctx, depth + 1);
+            } else if (stats) {
+                stats->backtracks++;
+            }
+        }
+
+        // Undo row r and the moves it forced, then move on to the next row,
+        // or straight back up if the search is stopping.
+        undo_forced(m, levels[depth].num_forced, indexed);
+        for (DLXNode j = m->left[r]; j != r; j = m->left[j])
+            search_uncover_column(m, m->column[j], indexed);
+        r = ctx->stop ? c : m->down[r];
+    }
+}
+
+static void dlx_search_scan(SolverContext* ctx) {
+    dlx_search(ctx, false, NULL);
+}
+
+static void dlx_search_buckets(SolverContext* ctx) {
+    dlx_search(ctx, true, NULL);
+}
+
+static void dlx_search_scan_stats(SolverContext* ctx) {
+    dlx_search(ctx, false, &ctx->stats);
+}
+
+static void dlx_search_buckets_stats(SolverContext* ctx) {
+    dlx_search(ctx, true, &ctx->stats);
+}
+
+// Searches for every solution from the current state of ctx->matrix, leaving
+// it as it was found. The cells that are forced from the start are filled in
+// first, so a puzzle that needs nothing more never reaches dlx_search().
+// Buckets come and go with each search, so the moves made here leave them
+// alone.
+void dlx_solve(SolverContext* ctx) {
+    DLXMatrix* m = ctx->matrix;
+    m->num_pending = 0;
+    m->num_forced = 0;
+    for (DLXNode j = m->right[0]; j != 0; j = m->right[j]) {
+        if (m->row_count[j] <= 1)
+            m->pending[m->num_pending++] = j;
+    }
+    bool stats = ctx->config->stats;
+    if (dlx_propagate(ctx, 0, false, stats ? &ctx->stats : NULL)) {
+        bool buckets = ctx->config->chooser == CHOOSER_BUCKETS;
+        if (m->right[0] == 0)
+            report_dlx_solution(ctx, 0);
+        else if (stats && buckets)
+            dlx_search_buckets_stats(ctx);
+        else if (stats)
+            dlx_search_scan_stats(ctx);
+        else if (buckets)
+            dlx_search_buckets(ctx);
+        else
+            dlx_search_scan(ctx);
+    }
+    undo_forced(m, 0, false);
+}
+
+// Fills in cols with the constraint columns (counting from 0 rather than from
+// the root) that placing value v in the given cell satisfies, and returns how
+// many there are: the four that every puzzle has, then those for the
+// diagonals that the cell is on. The rules are as for init_matrix_image().
+static inline int row_constraints(int puzzle_size, bool diagonal,
+                                  const int* regions, int cell, int v,
+                                  int* cols) {
+    int num_cells = puzzle_size * puzzle_size;
+    int block_size = sqrt(puzzle_size);
+    int r = cell / puzzle_size, c = cell % puzzle_size;
+    int block_index = regions ? regions[cell] :
+                      r - r % block_size + c / block_size;
+    int constraint_indices[4] = {
+        puzzle_size * r + c,               // row-column
+        puzzle_size * r + v - 1,           // row-value
+        puzzle_size * c + v - 1,           // column-value
+        puzzle_size * block_index + v - 1  // block-value
+    };
+    int n = 0;
+    for (int i = 0; i < 4; i++)
+        cols[n++] = i * num_cells + constraint_indices[i];
+    // The diagonals' columns come after all of those.
+    if (diagonal && r == c)
+        cols[n++] = 4 * num_cells + v - 1;
+    if (diagonal && r + c == puzzle_size - 1)
+        cols[n++] = 4 * num_cells + puzzle_size + v - 1;
+    return n;
+}
+
+// Builds the pristine matrix for puzzles of the given size, which is only
+// ever copied, so it has no search state of its own. For a variant, diagonal
+// adds a column for each value on each main diagonal, and regions (if not
+// NULL) takes the place of the boxes, as in Puzzle. Their rows differ in
+// length, so they are found through row_start.
+//
+// If givens (a value or 0 for each cell) is not NULL, the matrix is pruned to
+// that puzzle: the columns that the givens satisfy are left out, along with
+// every row that they rule out, and row_choices says what each row that is
+// left chooses. If the givens conflict, a single column is left, which no row
+// covers.
+static void init_matrix_image(DLXMatrix* m, int puzzle_size, bool diagonal,
+                              const int* regions, const int* givens) {
+    int num_cells = puzzle_size * puzzle_size;
+    int num_constraints = 4 * num_cells + (diagonal ? 2 * puzzle_size : 0);
+    int cols[6];
+
+    // Number the columns that are kept from 1, as their headers will be, and
+    // those left out 0.
+    DLXNode* header = xmalloc(sizeof(DLXNode) * num_constraints);
+    for (int i = 0; i < num_constraints; i++)
+        header[i] = 1;
+    bool conflict = false;
+    int num_empty = num_cells;
+    for (int cell = 0; givens && cell < num_cells; cell++) {
+        if (givens[cell] == 0)
+            continue;
+        num_empty--;
+        int n = row_constraints(puzzle_size, diagonal, regions, cell,
+                                givens[cell], cols);
+        for (int i = 0; i < n; i++) {
+            if (header[cols[i]] == 0)
+                conflict = true;
+            header[cols[i]] = 0;
+        }
+    }
+    int num_columns = 0;
+    for (int i = 0; i < num_constraints; i++) {
+        if (header[i] != 0)
+            header[i] = ++num_columns;
+    }
+    if (conflict)
+        num_columns = 1;
+
+    // Count the rows that are kept, and their nodes.
+    int num_rows = 0;
+    size_t num_nodes = num_columns + 1;
+    for (int cell = 0; !conflict && cell < num_cells; cell++) {
+        if (givens && givens[cell] != 0)
+            continue;
+        for (int v = 1; v < puzzle_size + 1; v++) {
+            int n = row_constraints(puzzle_size, diagonal, regions, cell, v,
+                                    cols);
+            bool kept = true;
+            for (int i = 0; i < n; i++)
+                kept = kept && header[cols[i]] != 0;
+            if (kept) {
+                num_rows++;
+                num_nodes += n;
+            }
+        }
+    }
+
+    // Allocate all of the arrays at once, then link the nodes together below.
+    DLXNode* nodes = xmalloc(sizeof(DLXNode) * 5 * num_nodes);
+    DLXNode *left = nodes, *right = nodes + num_nodes,
+            *up = nodes + 2 * num_nodes, *down = nodes + 3 * num_nodes,
+            *column = nodes + 4 * num_nodes;
+    int* row_count = xmalloc(sizeof(int) * (num_columns + 1));
+    DLXNode* row_start = diagonal || regions || givens ?
+                         xmalloc(sizeof(DLXNode) * (num_rows + 1)) : NULL;
+    int* row_choices = givens ? xmalloc(sizeof(int) * (num_rows + 1)) : NULL;
+
+    // Link up the column headers (which correspond to constraints).
+    DLXNode last_constraint = num_columns;
+    left[0] = last_constraint;
+    right[0] = 1;
+    up[0] = down[0] = column[0] = 0;
+    row_count[0] = 0;
+    // Keep a list of the bottom-most node in each column.
+    DLXNode* node_cols = xmalloc(sizeof(DLXNode) * num_columns);
+    for (int i = 0; i < num_columns; i++) {
+        DLXNode c = 1 + i;
+        left[c] = c - 1;
+        right[c] = c + 1;
+        column[c] = c;
+        row_count[c] = 0;
+        node_cols[i] = c;
+    }
+    right[last_constraint] = 0;
+
+    // Link up the row nodes.
+    DLXNode node = last_constraint + 1;
+    int row = 0;
+    for (int cell = 0; !conflict && cell < num_cells; cell++) {
+        if (givens && givens[cell] != 0)
+            continue;
+        for (int v = 1; v < puzzle_size + 1; v++) {
+            int n = row_constraints(puzzle_size, diagonal, regions, cell, v,
+                                    cols);
+            bool kept = true;
+            for (int i = 0; i < n; i++)
+                kept = kept && header[cols[i]] != 0;
+            if (!kept)
+                continue;
+            DLXNode start = node;
+            if (row_start)
+                row_start[row] = start;
+            if (row_choices)
+                row_choices[row] = puzzle_size * cell + v - 1;
+            row++;
+            for (int i = 0; i < n; i++) {
+                int idx = header[cols[i]] - 1;
+                DLXNode node_above = node_cols[idx];
+                up[node] = node_above;
+                left[node] = node - 1;
+                right[node] = node + 1;
+                column[node] = 1 + idx;
+                down[node_above] = node;
+                node_cols[idx] = node;
+                row_count[1 + idx]++;
+                node++;
+            }
+            left[start] = node - 1;
+            right[node - 1] = start;
+        }
+    }
+    if (row_start)
+        row_start[num_rows] = node;
+    for (int i = 0; i < num_columns; i++) {
+        DLXNode n = node_cols[i];
+        down[n] = column[n];
+        up[column[n]] = n;
+    }
+    free(node_cols);
+    free(header);
+
+    *m = (DLXMatrix) {
+        .size = puzzle_size,
+        .num_columns = num_columns,
+        .num_primary = num_columns,
+        .max_row_count = puzzle_size,
+        // Each level of the search fills in an empty cell.
+        .max_depth = num_empty > 0 ? num_empty : 1,
+        .num_nodes = num_nodes,
+        .left = left,
+        .right = right,
+        .up = up,
+        .down = down,
+        .column = column,
+        .row_count = row_count,
+        .first_row = last_constraint + 1,
+        .row_start = row_start,
+        .num_rows = row_start ? num_rows : 0,
+        .row_choices = row_choices,
+        .image = NULL,
+        .next = NULL
+    };
+}
+
+// Copies the search state of "from" into m, a matrix of the same size.
+// Covering only relinks nodes vertically and column headers horizontally, so
+// that is all that needs copying.
+void copy_matrix_state(DLXMatrix* m, const DLXMatrix* from) {
+    size_t header_bytes = sizeof(DLXNode) * (m->num_columns + 1);
+    memcpy(m->up, from->up, sizeof(DLXNode) * m->num_nodes);
+    memcpy(m->down, from->down, sizeof(DLXNode) * m->num_nodes);
+    memcpy(m->left, from->left, header_bytes);
+    memcpy(m->right, from->right, header_bytes);
+    memcpy(m->row_count, from->row_count, sizeof(int) * (m->num_columns + 1));
+}
+
+// Sets up m as a copy of image that can be searched.
+static void init_matrix(DLXMatrix* m, const DLXMatrix* image) {
+    int max_depth = image->max_depth;
+    int num_constraints = image->num_columns;
+    size_t num_nodes = image->num_nodes;
+    DLXNode* nodes = xmalloc(sizeof(DLXNode) * 4 * num_nodes);
+    int bucket_words = num_constraints / 64 + 1;
+    int summary_words = (bucket_words + 63) / 64;
+    *m = (DLXMatrix) {
+        .size = image->size,
+        .num_columns = num_constraints,
+        .num_primary = image->num_primary,
+        .max_row_count = image->max_row_count,
+        .max_depth = max_depth,
+        .num_nodes = num_nodes,
+        .left = nodes,
+        .right = nodes + num_nodes,
+        .up = nodes + 2 * num_nodes,
+        .down = nodes + 3 * num_nodes,
+        .column = image->column,
+        .row_count = xmalloc(sizeof(int) * (num_constraints + 1)),
+        .first_row = image->first_row,
+        .row_start = image->row_start,
+        .num_rows = image->num_rows,
+        .row_choices = image->row_choices,
+        .stack = xmalloc(sizeof(DLXNode) * max_depth),
+        .levels = xmalloc(sizeof(DLXLevel) * max_depth),
+        .pending = xmalloc(sizeof(DLXNode) * 2 * num_constraints),
+        .num_pending = 0,
+        .forced = xmalloc(sizeof(DLXNode) * max_depth),
+        .num_forced = 0,
+        .bucket_bits = xmalloc(sizeof(uint64_t) *
+                               (image->max_row_count + 1) * bucket_words),
+        .bucket_summary = xmalloc(sizeof(uint64_t) *
+                                  (image->max_row_count + 1) * summary_words),
+        .bucket_words = bucket_words,
+        .summary_words = summary_words,
+        .image = image,
+        .next = NULL
+    };
+    // The row nodes' left and right are never changed by covering.
+    memcpy(m->left, image->left, sizeof(DLXNode) * 2 * num_nodes);
+    copy_matrix_state(m, image);
+}
+
+static void free_matrix(DLXMatrix* m) {
+    free(m->bucket_summary);
+    free(m->bucket_bits);
+    free(m->forced);
+    free(m->pending);
+    free(m->levels);
+    free(m->stack);
+    free(m->row_count);
+    free(m->left);
+}
+
+// The pristine matrices built so far, one per size, shared by every thread.
+static DLXMatrix* matrix_images = NULL;
+static pthread_mutex_t matrix_images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const DLXMatrix* get_matrix_image(int size) {
+    pthread_mutex_lock(&matrix_images_lock);
+    DLXMatrix* image = matrix_images;
+    while (image && image->size != size)
+        image = image->next;
+    if (!image) {
+        image = xmalloc(sizeof(DLXMatrix));
+        init_matrix_image(image, size, false, NULL, NULL);
+        image->next = matrix_images;
+        matrix_images = image;
+    }
+    pthread_mutex_unlock(&matrix_images_lock);
+    return image;
+}
+
+void free_matrix_images(void) {
+    while (matrix_images) {
+        DLXMatrix* next = matrix_images->next;
+        free_matrix_image(matrix_images);
+        free(matrix_images);
+        matrix_images = next;
+    }
+}
+
+// Returns the copy of image in cache, making it the first time.
+DLXMatrix* get_image_matrix(DLXMatrix** cache, const DLXMatrix* image) {
+    for (DLXMatrix* m = *cache; m; m = m->next) {
+        if (m->image == image)
+            return m;
+    }
+    DLXMatrix* m = xmalloc(sizeof(DLXMatrix));
+    init_matrix(m, image);
+    m->next = *cache;
+    *cache = m;
+    return m;
+}
+
+// Returns the copy in cache of the standard matrix for puzzles of the given
+// size, making it the first time.
+DLXMatrix* get_matrix(DLXMatrix** cache, int size) {
+    for (DLXMatrix* m = *cache; m; m = m->next) {
+        // A variant's matrix may be of the same size, but has row_start.
+        if (m->size == size && !m->row_start)
+            return m;
+    }
+    return get_image_matrix(cache, get_matrix_image(size));
+}
+
+static void free_matrix_cache(DLXMatrix* cache) {
+    while (cache) {
+        DLXMatrix* next = cache->next;
+        free_matrix(cache);
+        free(cache);
+        cache = next;
+    }
+}
+
+// Prepares the pristine matrix m according to p's initial values. Returns
+// false if two of those values conflict, in which case the puzzle has no
+// solutions. Either way, reset_matrix() restores m afterwards.
+bool cover_givens(DLXMatrix* m, const Puzzle* p) {
+    // A matrix pruned to p has no rows for its givens, which it already
+    // takes into account.
+    if (m->row_choices)
+        return true;
+    for (int cell = 0; cell < p->num_cells; cell++) {
+        int v = p->cells[0][cell];
+        if (v == 0)
+            continue;
+
+        DLXNode dlx_row = choice_row(m, m->size * cell + v - 1);
+        if (!is_row_free(m, dlx_row))
+            return false;
+        cover_row(m, dlx_row);
+    }
+    return true;
+}
+
+// Returns m to the state of its image, whatever has been covered since. On
+// all but the emptiest puzzles this is quicker than uncovering the givens
+// again one by one.
+static void reset_matrix(DLXMatrix* m) {
+    copy_matrix_state(m, m->image);
+}
+
+// Whether config has dlx search p with a matrix pruned to its givens.
+bool use_pruned_matrix(const ProgramConfig* config, const Puzzle* p) {
+    return config->matrix == MATRIX_PRUNED ||
+           (config->matrix == MATRIX_AUTO && p->size >= kMinPrunedSize);
+}
+
+// Whether p is searched with a matrix built for it alone, rather than one
+// shared by every puzzle of its size: a variant's rules are its own, and a
+// pruned matrix depends on the givens.
+bool has_own_matrix(const ProgramConfig* config, const Puzzle* p) {
+    return is_variant(p) || use_pruned_matrix(config, p);
+}
+
+// Builds a pristine matrix for p alone, pruned to its givens if config says
+// so. free_puzzle_image() frees it.
+DLXMatrix* new_puzzle_image(const ProgramConfig* config, const Puzzle* p) {
+    DLXMatrix* image = xmalloc(sizeof(DLXMatrix));
+    init_matrix_image(image, p->size, p->diagonal, p->regions,
+                      use_pruned_matrix(config, p) ? p->cells[0] : NULL);
+    return image;
+}
+
+void free_puzzle_image(DLXMatrix* image) {
+    free_matrix_image(image);
+    free(image);
+}
+
+// Returns the matrix to search for p, with nothing covered: ctx's copy of
+// the one for p's size, or a copy of one built for p alone.
+// put_puzzle_matrix() restores or frees it afterwards.
+static DLXMatrix* get_puzzle_matrix(SolverContext* ctx, const Puzzle* p) {
+    if (!has_own_matrix(ctx->config, p))
+        return get_matrix(&ctx->matrices, p->size);
+    DLXMatrix* m = xmalloc(sizeof(DLXMatrix));
+    init_matrix(m, new_puzzle_image(ctx->config, p));
+    return m;
+}
+
+static void put_puzzle_matrix(SolverContext* ctx, DLXMatrix* m,
+                              const Puzzle* p) {
+    if (!has_own_matrix(ctx->config, p)) {
+        reset_matrix(m);
+        return;
+    }
+    DLXMatrix* image = (DLXMatrix*) m->image;
+    free_matrix(m);
+    free(m);
+    free_puzzle_image(image);
+}
+
+// Returns the values that could still go in the given empty cell.
+static inline BitboardMask bitboard_candidates(Bitboard* b, int cell) {
+    return b->all_values & ~(b->row_used[b->cell_row[cell]] |
+                             b->col_used[b->cell_col[cell]] |
+                             b->block_used[b->cell_block[cell]]);
+}
+
+// The vectorized scans go through the grid a row at a time, working on as
+// many cells of the row at once as fit in a vector. Lanes past the end of a
+// row spill over into the next one (or the padding) and are ignored, apart
+// from what they store into b->cand, which the next row then overwrites.
+#ifdef HAVE_X86_SIMD
+// Gathers the values used in the block of each cell of the band starting at
+// row r.
+static inline __attribute__((always_inline))
+void bitboard_fill_band(Bitboard* b, int r, int size, int block_size) {
+    for (int c = 0; c < size; c++)
+        b->band_used[c] = b->block_used[r + c / block_size];
+}
+
+// Sets b->hidden[u] from the values found once and twice or more in unit u.
+static inline bool bitboard_set_hidden(Bitboard* b, int u, BitboardMask once,
+                                       BitboardMask twice) {
+    if ((once | b->unit_used[u]) != b->all_values)
+        return false;
+    b->hidden[u] = once & ~twice;
+    return true;
+}
+
+// Handles the rows for the vectorized versions of find_hidden, which lie
+// along the vectors rather than across them.
+static inline __attribute__((always_inline))
+bool bitboard_find_hidden_rows(Bitboard* b, int size) {
+    for (int r = 0; r < size; r++) {
+        const BitboardMask* cand = b->cand + r * size;
+        BitboardMask once = 0, twice = 0;
+        for (int c = 0; c < size; c++) {
+            twice |= once & cand[c];
+            once |= cand[c];
+        }
+        if (!bitboard_set_hidden(b, r, once, twice))
+            return false;
+    }
+    return true;
+}
+
+// Combines the per-column counts for the band ending at row r into its
+// blocks.
+static inline __attribute__((always_inline))
+bool bitboard_find_hidden_band(Bitboard* b, int r, const BitboardMask* once,
+                               const BitboardMask* twice, int size,
+                               int block_size) {
+    for (int k = 0; k < block_size; k++) {
+        BitboardMask block_once = 0, block_twice = 0;
+        for (int c = k * block_size; c < (k + 1) * block_size; c++) {
+            block_twice |= twice[c] | (block_once & once[c]);
+            block_once |= once[c];
+        }
+        int block = r + 1 - block_size + k;
+        if (!bitboard_set_hidden(b, 2 * size + block, block_once,
+                                 block_twice))
+            return false;
+    }
+    return true;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i popcount_epi32_avx2(__m256i v) {
+    // Look up the count for each nibble, then add up the bytes of each lane.
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low_nibbles);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles);
+    __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                    _mm256_shuffle_epi8(lut, hi));
+    __m256i words = _mm256_maddubs_epi16(bytes, _mm256_set1_epi8(1));
+    return _mm256_madd_epi16(words, _mm256_set1_epi16(1));
+}
+
+// Like the search functions, the vectorized scans are written for any size,
+// and DEFINE_BITBOARD_SCANS() builds versions of them for fixed sizes.
+__attribute__((target("avx2"), always_inline))
+static inline uint32_t bitboard_scan_avx2(Bitboard* b, int size,
+                                          int block_size) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i all_values = _mm256_set1_epi32(b->all_values);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i best = _mm256_set1_epi32(-1);
+    for (int r = 0; r < size; r++) {
+        if (r % block_size == 0)
+            bitboard_fill_band(b, r, size, block_size);
+        __m256i row_used = _mm256_set1_epi32(b->row_used[r]);
+        for (int c = 0; c < size; c += 8) {
+            int cell = r * size + c;
+            __m256i used = _mm256_or_si256(row_used, _mm256_or_si256(
+                _mm256_loadu_si256((const __m256i*) (b->col_used + c)),
+                _mm256_loadu_si256((const __m256i*) (b->band_used + c))));
+            __m256i values = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i*) (b->cells + cell)));
+            __m256i filled = _mm256_xor_si256(_mm256_cmpeq_epi32(values, zero),
+                                              _mm256_set1_epi32(-1));
+            __m256i cand = _mm256_andnot_si256(_mm256_or_si256(used, filled),
+                                               all_values);
+            _mm256_storeu_si256((__m256i*) (b->cand + cell), cand);
+
+            // Filled cells and lanes past the end of the row never win.
+            __m256i key = _mm256_or_si256(
+                _mm256_slli_epi32(popcount_epi32_avx2(cand), 16),
+                _mm256_add_epi32(_mm256_set1_epi32(cell), lanes));
+            __m256i past_end = _mm256_cmpgt_epi32(
+                lanes, _mm256_set1_epi32(size - c - 1));
+            __m256i skip = _mm256_or_si256(filled, past_end);
+            best = _mm256_min_epu32(best, _mm256_or_si256(key, skip));
+        }
+    }
+    __m128i m = _mm_min_epu32(_mm256_castsi256_si128(best),
+                              _mm256_extracti128_si256(best, 1));
+    m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(m);
+}
+
+// Counts the columns and blocks a band at a time, with one lane per column.
+__attribute__((target("avx2"), always_inline))
+static inline bool bitboard_find_hidden_avx2(Bitboard* b, int size,
+                                             int block_size) {
+    int num_vectors = (size + 7) / 8;
+    __m256i col_once[4], col_twice[4], band_once[4], band_twice[4];
+    // Enough lanes for a 25x25 row.
+    BitboardMask once[32], twice[32];
+    for (int v = 0; v < num_vectors; v++) {
+        col_once[v] = col_twice[v] = _mm256_setzero_si256();
+        band_once[v] = band_twice[v] = _mm256_setzero_si256();
+    }
+    for (int r = 0; r < size; r++) {
+        for (int v = 0; v < num_vectors; v++) {
+            __m256i cand = _mm256_loadu_si256(
+                (const __m256i*) (b->cand + r * size + 8 * v));
+            col_twice[v] = _mm256_or_si256(col_twice[v],
+                                           _mm256_and_si256(col_once[v], cand));
+            col_once[v] = _mm256_or_si256(col_once[v], cand);
+            band_twice[v] = _mm256_or_si256(
+                band_twice[v], _mm256_and_si256(band_once[v], cand));
+            band_once[v] = _mm256_or_si256(band_once[v], cand);
+        }
+        if (r % block_size == block_size - 1) {
+            for (int v = 0; v < num_vectors; v++) {
+                _mm256_storeu_si256((__m256i*) (once + 8 * v), band_once[v]);
+                _mm256_storeu_si256((__m256i*) (twice + 8 * v), band_twice[v]);
+                band_once[v] = band_twice[v] = _mm256_setzero_si256();
+            }
+            if (!bitboard_find_hidden_band(b, r, once, twice, size,
+                                           block_size))
+                return false;
+        }
+    }
+    for (int v = 0; v < num_vectors; v++) {
+        _mm256_storeu_si256((__m256i*) (once + 8 * v), col_once[v]);
+        _mm256_storeu_si256((__m256i*) (twice + 8 * v), col_twice[v]);
+    }
+    for (int c = 0; c < size; c++) {
+        if (!bitboard_set_hidden(b, size + c, once[c], twice[c]))
+            return false;
+    }
+    return bitboard_find_hidden_rows(b, size);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"), always_inline))
+static inline uint32_t bitboard_scan_avx512(Bitboard* b, int size,
+                                            int block_size) {
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                            8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i all_values = _mm512_set1_epi32(b->all_values);
+    __m512i best = _mm512_set1_epi32(-1);
+    for (int r = 0; r < size; r++) {
+        if (r % block_size == 0)
+            bitboard_fill_band(b, r, size, block_size);
+        __m512i row_used = _mm512_set1_epi32(b->row_used[r]);
+        for (int c = 0; c < size; c += 16) {
+            int cell = r * size + c;
+            __mmask16 in_row = size - c >= 16 ? 0xffff :
+                               (1u << (size - c)) - 1;
+            __m512i used = _mm512_or_si512(row_used, _mm512_or_si512(
+                _mm512_loadu_si512(b->col_used + c),
+                _mm512_loadu_si512(b->band_used + c)));
+            __m512i values = _mm512_cvtepu8_epi32(
+                _mm_loadu_si128((const __m128i*) (b->cells + cell)));
+            __mmask16 empty = _mm512_testn_epi32_mask(values, values);
+            __m512i cand = _mm512_maskz_andnot_epi32(empty, used, all_values);
+            _mm512_mask_storeu_epi32(b->cand + cell, in_row, cand);
+
+            __m512i key = _mm512_or_si512(
+                _mm512_slli_epi32(_mm512_popcnt_epi32(cand), 16),
+                _mm512_add_epi32(_mm512_set1_epi32(cell), lanes));
+            best = _mm512_mask_min_epu32(best, in_row & empty, best, key);
+        }
+    }
+    return _mm512_reduce_min_epu32(best);
+}
+
+// The same as bitboard_find_hidden_avx2(), but twice as wide.
+__attribute__((target("avx512f"), always_inline))
+static inline bool bitboard_find_hidden_avx512(Bitboard* b, int size,
+                                               int block_size) {
+    int num_vectors = (size + 15) / 16;
+    __m512i col_once[2], col_twice[2], band_once[2], band_twice[2];
+    BitboardMask once[32], twice[32];
+    for (int v = 0; v < num_vectors; v++) {
+        col_once[v] = col_twice[v] = _mm512_setzero_si512();
+        band_once[v] = band_twice[v] = _mm512_setzero_si512();
+    }
+    for (int r = 0; r < size; r++) {
+        for (int v = 0; v < num_vectors; v++) {
+            __m512i cand = _mm512_loadu_si512(b->cand + r * size + 16 * v);
+            col_twice[v] = _mm512_or_si512(col_twice[v],
+                                           _mm512_and_si512(col_once[v], cand));
+            col_once[v] = _mm512_or_si512(col_once[v], cand);
+            band_twice[v] = _mm512_or_si512(
+                band_twice[v], _mm512_and_si512(band_once[v], cand));
+            band_once[v] = _mm512_or_si512(band_once[v], cand);
+        }
+        if (r % block_size == block_size - 1) {
+            for (int v = 0; v < num_vectors; v++) {
+                _mm512_storeu_si512(once + 16 * v, band_once[v]);
+                _mm512_storeu_si512(twice + 16 * v, band_twice[v]);
+                band_once[v] = band_twice[v] = _mm512_setzero_si512();
+            }
+            if (!bitboard_find_hidden_band(b, r, once, twice, size,
+                                           block_size))
+                return false;
+        }
+    }
+    for (int v = 0; v < num_vectors; v++) {
+        _mm512_storeu_si512(once + 16 * v, col_once[v]);
+        _mm512_storeu_si512(twice + 16 * v, col_twice[v]);
+    }
+    for (int c = 0; c < size; c++) {
+        if (!bitboard_set_hidden(b, size + c, once[c], twice[c]))
+            return false;
+    }
+    return bitboard_find_hidden_rows(b, size);
+}
+
+#define DEFINE_BITBOARD_SCANS(isa, scan_target, hidden_target, suffix, \
+                              size, block_size) \
+    __attribute__((target(scan_target))) \
+    static uint32_t bitboard_scan_##isa##suffix(Bitboard* b) { \
+        return bitboard_scan_##isa(b, size, block_size); \
+    } \
+    __attribute__((target(hidden_target))) \
+    static bool bitboard_find_hidden_##isa##suffix(Bitboard* b) { \
+        return bitboard_find_hidden_##isa(b, size, block_size); \
+    }
+
+DEFINE_BITBOARD_SCANS(avx2, "avx2", "avx2", _16, 16, 4)
+DEFINE_BITBOARD_SCANS(avx2, "avx2", "avx2", _25, 25, 5)
+DEFINE_BITBOARD_SCANS(avx2, "avx2", "avx2", _any, b->size, b->block_size)
+DEFINE_BITBOARD_SCANS(avx512, "avx512f,avx512vpopcntdq", "avx512f", _16, 16, 4)
+DEFINE_BITBOARD_SCANS(avx512, "avx512f,avx512vpopcntdq", "avx512f", _25, 25, 5)
+DEFINE_BITBOARD_SCANS(avx512, "avx512f,avx512vpopcntdq", "avx512f", _any,
+                      b->size, b->block_size)
+#endif
+
+// Picks the fastest vectorized scans that this CPU supports for the given
+// size, if any beat the scalar search.
+static void select_bitboard_scans(Bitboard* b) {
+    b->scan = NULL;
+    b->find_hidden = NULL;
+#ifdef HAVE_X86_SIMD
+    // Below 16x16, rows are too short to fill a vector.
+    if (b->size < 16)
+        return;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vpopcntdq")) {
+        b->scan = b->size == 16 ? bitboard_scan_avx512_16 :
+                  b->size == 25 ? bitboard_scan_avx512_25 :
+                                  bitboard_scan_avx512_any;
+        b->find_hidden = b->size == 16 ? bitboard_find_hidden_avx512_16 :
+                         b->size == 25 ? bitboard_find_hidden_avx512_25 :
+                                         bitboard_find_hidden_avx512_any;
+    } else if (__builtin_cpu_supports("avx2")) {
+        b->scan = b->size == 16 ? bitboard_scan_avx2_16 :
+                  b->size == 25 ? bitboard_scan_avx2_25 :
+                                  bitboard_scan_avx2_any;
+        b->find_hidden = b->size == 16 ? bitboard_find_hidden_avx2_16 :
+                         b->size == 25 ? bitboard_find_hidden_avx2_25 :
+                                         bitboard_find_hidden_avx2_any;
+    }
+#endif
+}
+
+static void init_bitboard(Bitboard* b, int size) {
+    int num_cells = size * size;
+    int block_size = sqrt(size);
+    b->size = size;
+    b->block_size = block_size;
+    b->num_cells = num_cells;
+    b->all_values = (BitboardMask) ((UINT64_C(1) << size) - 1);
+    select_bitboard_scans(b);
+    b->cell_row = xmalloc(num_cells);
+    b->cell_col = xmalloc(num_cells);
+    b->cell_block = xmalloc(num_cells);
+    b->unit_cells = xmalloc(sizeof(uint16_t) * 3 * num_cells);
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++) {
+            int cell = r * size + c;
+            int block = r - r % block_size + c / block_size;
+            int block_pos = r % block_size * block_size + c % block_size;
+            b->cell_row[cell] = r;
+            b->cell_col[cell] = c;
+            b->cell_block[cell] = block;
+            b->unit_cells[r * size + c] = cell;
+            b->unit_cells[(size + c) * size + r] = cell;
+            b->unit_cells[(2 * size + block) * size + block_pos] = cell;
+        }
+    }
+    b->unit_used = xmalloc(sizeof(BitboardMask) *
+                           (3 * size + kBitboardPadding));
+    b->row_used = b->unit_used;
+    b->col_used = b->row_used + size;
+    b->block_used = b->col_used + size;
+    b->band_used = xmalloc(sizeof(BitboardMask) * (size + kBitboardPadding));
+    b->cand = xmalloc(sizeof(BitboardMask) * (num_cells + kBitboardPadding));
+    memset(b->cand, 0, sizeof(BitboardMask) * (num_cells + kBitboardPadding));
+    b->hidden = xmalloc(sizeof(BitboardMask) * 3 * size);
+    b->cells = xmalloc(num_cells + kBitboardPadding);
+    b->empty_cells = xmalloc(sizeof(uint16_t) * 2 * num_cells);
+    b->empty_pos = b->empty_cells + num_cells;
+    b->trail = xmalloc(sizeof(uint16_t) * num_cells);
+    b->next = NULL;
+}
+
+static void free_bitboard(Bitboard* b) {
+    free(b->trail);
+    free(b->empty_cells);
+    free(b->cells);
+    free(b->hidden);
+    free(b->cand);
+    free(b->band_used);
+    free(b->unit_used);
+    free(b->unit_cells);
+    free(b->cell_block);
+    free(b->cell_col);
+    free(b->cell_row);
+}
+
+// Like get_matrix(), but for the bitboard engine.
+Bitboard* get_bitboard(Bitboard** cache, int size) {
+    for (Bitboard* b = *cache; b; b = b->next) {
+        if (b->size == size)
+            return b;
+    }
+    Bitboard* b = xmalloc(sizeof(Bitboard));
+    init_bitboard(b, size);
+    b->next = *cache;
+    *cache = b;
+    return b;
+}
+
+static void free_bitboard_cache(Bitboard* cache) {
+    while (cache) {
+        Bitboard* next = cache->next;
+        free_bitboard(cache);
+        free(cache);
+        cache = next;
+    }
+}
+
+static inline void bitboard_place(Bitboard* b, int cell, BitboardMask value) {
+    b->cells[cell] = __builtin_ctz(value) + 1;
+    b->row_used[b->cell_row[cell]] |= value;
+    b->col_used[b->cell_col[cell]] |= value;
+    b->block_used[b->cell_block[cell]] |= value;
+    b->trail[b->trail_len++] = cell;
+
+    // Move the cell to just past the end of the empty list. As cells are
+    // always cleared in the reverse order, bitboard_undo() then only has to
+    // extend the list by one to put the cell back.
+    int pos = b->empty_pos[cell];
+    int last = b->empty_cells[--b->num_empty];
+    b->empty_cells[pos] = last;
+    b->empty_pos[last] = pos;
+    b->empty_cells[b->num_empty] = cell;
+    b->empty_pos[cell] = b->num_empty;
+}
+
+// Clears every cell placed since the trail was trail_len long.
+static void bitboard_undo(Bitboard* b, int trail_len) {
+    while (b->trail_len > trail_len) {
+        int cell = b->trail[--b->trail_len];
+        BitboardMask value = 1u << (b->cells[cell] - 1);
+        b->row_used[b->cell_row[cell]] &= ~value;
+        b->col_used[b->cell_col[cell]] &= ~value;
+        b->block_used[b->cell_block[cell]] &= ~value;
+        b->cells[cell] = 0;
+        b->num_empty++;
+    }
+}
+
+// The search functions below take the puzzle size as an argument and are
+// always inlined, so that each of the versions built by
+// DEFINE_BITBOARD_SEARCH() for a fixed size has it as a constant. The loop
+// bounds and unit offsets are then fixed at compile time.
+
+// Fills in naked singles (cells with one candidate left) and hidden singles
+// (values with one place left in some row, column or block) until neither
+// remains. Returns -1 if this shows that there are no solutions from here.
+// Otherwise, returns the empty cell with the fewest candidates, or
+// num_cells if every cell has been filled.
+static inline __attribute__((always_inline))
+int bitboard_propagate(Bitboard* b, int size) {
+    int num_cells = size * size;
+    for (;;) {
+        bool progress = false;
+        int best_cell = num_cells;
+        int best_count = size + 1;
+        // Placing a cell moves it out of the list, so walk it backwards.
+        for (int i = b->num_empty - 1; i >= 0; i--) {
+            int cell = b->empty_cells[i];
+            BitboardMask cand = bitboard_candidates(b, cell);
+            if (cand == 0)
+                return -1;
+            if ((cand & (cand - 1)) == 0) {
+                bitboard_place(b, cell, cand);
+                progress = true;
+                continue;
+            }
+            int count = __builtin_popcount(cand);
+            if (count < best_count) {
+                best_cell = cell;
+                best_count = count;
+            }
+        }
+        if (progress)
+            continue;
+
+        for (int u = 0; u < 3 * size; u++) {
+            const uint16_t* unit = b->unit_cells + u * size;
+            // Find the values that are candidates in exactly one cell.
+            BitboardMask once = 0, twice = 0;
+            // With a fixed size, this loop unrolls completely.
+#pragma GCC unroll 25
+            for (int i = 0; i < size; i++) {
+                int cell = unit[i];
+                if (b->cells[cell] == 0) {
+                    BitboardMask cand = bitboard_candidates(b, cell);
+                    twice |= once & cand;
+                    once |= cand;
+                }
+            }
+            if ((b->unit_used[u] | once) != b->all_values)
+                return -1;
+
+            BitboardMask hidden = once & ~twice;
+            while (hidden) {
+                BitboardMask value = hidden & -hidden;
+                hidden ^= value;
+                // An earlier placement in this unit may have taken the last
+                // place for this value.
+                int i = 0;
+                while (i < size && (b->cells[unit[i]] != 0 ||
+                        !(bitboard_candidates(b, unit[i]) & value)))
+                    i++;
+                if (i == size)
+                    return -1;
+                bitboard_place(b, unit[i], value);
+                progress = true;
+            }
+        }
+        if (!progress)
+            return best_cell;
+    }
+}
+
+// The same as bitboard_propagate(), but built on the vectorized scans.
+// These work on every cell at once, so rather than placing each single as
+// soon as it is found, each scan's singles are placed together afterwards.
+static inline __attribute__((always_inline))
+int bitboard_propagate_vector(Bitboard* b, int size) {
+    for (;;) {
+        uint32_t best = b->scan(b);
+        if (best == UINT32_MAX)
+            return size * size;
+        int best_count = best >> 16;
+        if (best_count == 0)
+            return -1;
+        if (best_count == 1) {
+            for (int i = b->num_empty - 1; i >= 0; i--) {
+                int cell = b->empty_cells[i];
+                BitboardMask cand = b->cand[cell];
+                if ((cand & (cand - 1)) != 0)
+                    continue;
+                // An earlier single may have taken this one's value.
+                if (!(bitboard_candidates(b, cell) & cand))
+                    return -1;
+                bitboard_place(b, cell, cand);
+            }
+            continue;
+        }
+
+        if (!b->find_hidden(b))
+            return -1;
+        // Placing hidden singles makes b->cand out of date, but only by
+        // listing too many candidates. A value that b->cand has in just one
+        // place in a unit is still in at most that one, unless it has since
+        // been placed elsewhere in the unit.
+        bool progress = false;
+        for (int u = 0; u < 3 * size; u++) {
+            const uint16_t* unit = b->unit_cells + u * size;
+            BitboardMask hidden = b->hidden[u] & ~b->unit_used[u];
+            while (hidden) {
+                BitboardMask value = hidden & -hidden;
+                hidden ^= value;
+                int i = 0;
+                while (!(b->cand[unit[i]] & value))
+                    i++;
+                if (b->cells[unit[i]] != 0 ||
+                    !(bitboard_candidates(b, unit[i]) & value))
+                    return -1;
+                bitboard_place(b, unit[i], value);
+                progress = true;
+            }
+        }
+        if (!progress)
+            return best & 0xffff;
+    }
+}
+
+typedef void (*BitboardSearchFunc)(SolverContext* ctx, Bitboard* b);
+
+// Searches for every solution from the current state of b, recursing through
+// search, which is the version of this function for b's size and stats. What
+// the search does is counted in stats, unless it is NULL.
+static inline __attribute__((always_inline))
+void bitboard_search(SolverContext* ctx, Bitboard* b, int size,
+                     SolverStats* stats, BitboardSearchFunc search) {
+    int num_cells = size * size;
+    int trail_len = b->trail_len;
+    // Only 16x16 and up ever have vectorized scans.
+    int cell = size >= 16 && b->scan ? bitboard_propagate_vector(b, size) :
+                                       bitboard_propagate(b, size);
+    if (stats && cell < 0 && stats->depth > 0)
+        stats->backtracks++;
+    if (cell == num_cells) {
+        // Found a solution.
+        for (int i = 0; i < num_cells; i++)
+            ctx->solution->cells[0][i] = b->cells[i];
+        report_solution(ctx);
+    } else if (cell >= 0) {
+        BitboardMask cand = bitboard_candidates(b, cell);
+        while (cand) {
+            if (--ctx->poll_countdown == 0 && poll_budget(ctx))
+                break;
+            BitboardMask value = cand & -cand;
+            cand ^= value;
+            int branch_trail_len = b->trail_len;
+            if (stats) {
+                stats->nodes++;
+                if (++stats->depth > stats->max_depth)
+                    stats->max_depth = stats->depth;
+            }
+            bitboard_place(b, cell, value);
+            search(ctx, b);
+            bitboard_undo(b, branch_trail_len);
+            if (stats)
+                stats->depth--;
+            if (ctx->stop)
+                break;
+        }
+    }
+    bitboard_undo(b, trail_len);
+}
+
+#define DEFINE_BITBOARD_SEARCH(name, size) \
+    static void name(SolverContext* ctx, Bitboard* b) { \
+        bitboard_search(ctx, b, size, NULL, name); \
+    } \
+    static void name##_stats(SolverContext* ctx, Bitboard* b) { \
+        bitboard_search(ctx, b, size, &ctx->stats, name##_stats); \
+    }
+
+DEFINE_BITBOARD_SEARCH(bitboard_search_4, 4)
+DEFINE_BITBOARD_SEARCH(bitboard_search_9, 9)
+DEFINE_BITBOARD_SEARCH(bitboard_search_16, 16)
+DEFINE_BITBOARD_SEARCH(bitboard_search_25, 25)
+// The fallback for the other sizes.
+DEFINE_BITBOARD_SEARCH(bitboard_search_any, b->size)
+
+// Sets up b with p's initial values. Returns false if two of them conflict, in
+// which case the puzzle has no solutions.
+static bool bitboard_place_givens(Bitboard* b, const Puzzle* p) {
+    memset(b->unit_used, 0,
+           sizeof(BitboardMask) * (3 * b->size + kBitboardPadding));
+    memset(b->cells, 0, b->num_cells + kBitboardPadding);
+    for (int cell = 0; cell < b->num_cells; cell++) {
+        b->empty_cells[cell] = cell;
+        b->empty_pos[cell] = cell;
+    }
+    b->num_empty = b->num_cells;
+    b->trail_len = 0;
+    for (int cell = 0; cell < p->num_cells; cell++) {
+        int v = p->cells[0][cell];
+        if (v == 0)
+            continue;
+        BitboardMask value = 1u << (v - 1);
+        if (!(bitboard_candidates(b, cell) & value))
+            return false;
+        bitboard_place(b, cell, value);
+    }
+    // The givens stay in place for the whole search.
+    b->trail_len = 0;
+    return true;
+}
+
+// Searches for every solution of the puzzle set up in b.
+static void bitboard_solve(SolverContext* ctx, Bitboard* b) {
+    bool stats = ctx->config->stats;
+    BitboardSearchFunc search;
+    switch (b->size) {
+    case 4:
+        search = stats ? bitboard_search_4_stats : bitboard_search_4;
+        break;
+    case 9:
+        search = stats ? bitboard_search_9_stats : bitboard_search_9;
+        break;
+    case 16:
+        search = stats ? bitboard_search_16_stats : bitboard_search_16;
+        break;
+    case 25:
+        search = stats ? bitboard_search_25_stats : bitboard_search_25;
+        break;
+    default:
+        search = stats ? bitboard_search_any_stats : bitboard_search_any;
+        break;
+    }
+    search(ctx, b);
+}
+
+void init_solver(SolverContext* ctx, const ProgramConfig* config) {
+    *ctx = (SolverContext) {
+        .config = config,
+        .matrices = NULL,
+        .bitboards = NULL,
+        .shared_solutions = NULL,
+        .out = NULL,
+        .first_solution = NULL,
+        .callback = !(config->packed || config->print_solutions) ? NULL :
+                    config->exact_cover ? print_cover_solution :
+                    print_solution,
+        .callback_data = ctx,
+        .poll_countdown = kPollNodes
+    };
+    init_arena(&ctx->arena);
+}
+
+void destroy_solver(SolverContext* ctx) {
+    free_arena(&ctx->arena);
+    free_matrix_cache(ctx->matrices);
+    free_bitboard_cache(ctx->bitboards);
+}
+
+// For --stats, adds the time since the end of the last phase of solving the
+// current puzzle to *phase.
+void end_stats_phase(SolverContext* ctx, double* phase) {
+    if (!ctx->config->stats)
+        return;
+    double now = monotonic_seconds();
+    *phase += now - ctx->stats.phase_start;
+    ctx->stats.phase_start = now;
+}
+
+// Finishes the output for a puzzle of the given size (0 for --exact-cover),
+// whose search found num_solutions before it finished or was interrupted.
+// Packed output has a record for every puzzle, so one with no solutions gets
+// an empty grid.
+void print_summary(OutputBuffer* out, const ProgramConfig* config,
+                   int size, uint64_t num_solutions, bool interrupted) {
+    static const char kNoSolutions[] = "The puzzle has no solutions.\n";
+    static const char kNoCovers[] = "The matrix has no exact covers.\n";
+    static const char kInterrupted[] =
+        "The search was stopped before it finished.\n";
+    if (config->packed) {
+        if (num_solutions == 0) {
+            size_t n = packed_record_size(size);
+            memset(reserve_output(out, n), 0, n);
+            commit_output(out, out->data + out->len + n);
+        }
+    } else if (config->print_num_solutions)
+        format_output(out, "%" PRIu64 "\n", num_solutions);
+    else if (interrupted) {
+        // Set the message apart from the last grid, as print_solution()
+        // does each grid from the one before.
+        if (num_solutions > 0 && !config->one_line && !config->exact_cover)
+            append_output(out, "\n", 1);
+        append_output(out, kInterrupted, sizeof(kInterrupted) - 1);
+    } else if (num_solutions == 0 && config->exact_cover)
+        append_output(out, kNoCovers, sizeof(kNoCovers) - 1);
+    else if (num_solutions == 0)
+        append_output(out, kNoSolutions, sizeof(kNoSolutions) - 1);
+}
+
+static Engine select_engine(const ProgramConfig* config, const Puzzle* p) {
+    if (config->engine != ENGINE_DLX && p->size <= kMaxBitboardSize &&
+        !is_variant(p) && !config->checkpoint_path && !config->resume_path)
+        return ENGINE_BITBOARD;
+    return ENGINE_DLX;
+}
+
+// Looks up the puzzle whose canonical form is cells under t. If the cache
+// knows everything that solving it would print, reports the result as the
+// search would have and returns true.
+static bool use_cached_result(SolverContext* ctx, const PuzzleTransform* t,
+                              uint64_t hash, const uint16_t* cells) {
+    const ProgramConfig* config = ctx->config;
+    ResultCache* c = config->cache;
+    int size = ctx->solution->size;
+    pthread_mutex_lock(&c->lock);
+    CacheEntry* e = find_cache_entry(c, hash, size, cells);
+    uint64_t n = 0;
+    bool hit = false, has_solution = false;
+    if (e) {
+        n = e->num_solutions < config->max_solutions ? e->num_solutions :
+                                                       config->max_solutions;
+        // A search that stopped at its limit only says as much for a limit
+        // no higher. Printing the solutions needs every one of them, which
+        // are only kept for a puzzle that has just the one.
+        hit = (e->complete || config->max_solutions <= e->num_solutions) &&
+              (config->print_num_solutions || n == 0 || e->has_solution);
+        has_solution = hit && e->has_solution && n > 0;
+    }
+    if (hit) {
+        unlink_cache_entry(c, e);
+        push_cache_entry(c, e);
+        if (has_solution)
+            original_solution(e->cells + size * size, size, t,
+                              ctx->solution->cells[0]);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (has_solution)
+        report_solution(ctx);
+    else if (hit)
+        ctx->num_solutions = n;
+    return hit;
+}
+
+// Adds the result of the search just finished to the cache.
+static void cache_result(SolverContext* ctx, const PuzzleTransform* t,
+                         uint64_t hash, const uint16_t* cells) {
+    ResultCache* c = ctx->config->cache;
+    int size = ctx->solution->size;
+    uint64_t n = ctx->num_solutions;
+    bool complete = n < ctx->config->max_solutions;
+    CacheEntry* e = new_cache_entry(size, complete && n == 1);
+    e->hash = hash;
+    e->num_solutions = n;
+    e->complete = complete;
+    memcpy(e->cells, cells, sizeof(uint16_t) * size * size);
+    if (e->has_solution)
+        canonical_solution(ctx->first_solution, size, t,
+                           e->cells + size * size);
+
+    pthread_mutex_lock(&c->lock);
+    // Keep what is already known if this says no more.
+    CacheEntry* old = find_cache_entry(c, hash, size, cells);
+    if (old && (old->complete || (!complete && old->num_solutions >= n))) {
+        free(e);
+    } else {
+        if (c->log.fd >= 0)
+            write_cache_entry(&c->log, e);
+        insert_cache_entry(c, e);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Searches for the solutions of p, which ctx->solution must start out a copy
+// of, with the engine chosen by ctx->config.
+void run_engine(SolverContext* ctx, const Puzzle* p) {
+    if (select_engine(ctx->config, p) == ENGINE_BITBOARD) {
+        Bitboard* b = get_bitboard(&ctx->bitboards, p->size);
+        bool ok = bitboard_place_givens(b, p);
+        end_stats_phase(ctx, &ctx->stats.setup_seconds);
+        if (ok)
+            bitboard_solve(ctx, b);
+        end_stats_phase(ctx, &ctx->stats.search_seconds);
+    } else {
+        DLXMatrix* m = get_puzzle_matrix(ctx, p);
+        ctx->matrix = m;
+        bool ok = cover_givens(m, p);
+        end_stats_phase(ctx, &ctx->stats.setup_seconds);
+        if (ok)
+            dlx_solve(ctx);
+        end_stats_phase(ctx, &ctx->stats.search_seconds);
+        put_puzzle_matrix(ctx, m, p);
+        end_stats_phase(ctx, &ctx->stats.setup_seconds);
+    }
+}
+
+// Gives the search that is about to start until config->timeout from now.
+void start_deadline(SolverContext* ctx) {
+    double timeout = ctx->config->timeout;
+    ctx->deadline = timeout > 0 ? monotonic_seconds() + timeout : 0;
+    ctx->poll_countdown = kPollNodes;
+    ctx->interrupted = false;
+}
+
+// Solves p, printing the results to ctx->out. Returns the number of solutions
+// found. ctx->interrupted says whether the search finished.
+uint64_t solve_puzzle(SolverContext* ctx, Puzzle* p) {
+    Puzzle solution;
+    copy_puzzle(&solution, p, &ctx->arena);
+    ctx->init = p;
+    ctx->solution = &solution;
+    ctx->num_solutions = ctx->resume ? ctx->resume->num_solutions : 0;
+    ctx->stop = false;
+    start_deadline(ctx);
+    if (ctx->config->stats)
+        ctx->stats = (SolverStats) { .phase_start = monotonic_seconds() };
+
+    // The cache's canonical forms only hold for plain sudoku.
+    bool use_cache = ctx->config->cache && !ctx->config->convert &&
+                     !is_variant(p);
+    PuzzleTransform t;
+    uint16_t* cells = NULL;
+    uint64_t hash = 0;
+    if (use_cache) {
+        cells = arena_alloc(&ctx->arena, sizeof(uint16_t) * p->num_cells);
+        canonicalize_puzzle(p, &t, cells, &ctx->arena);
+        hash = hash_cells(cells, p->size);
+        if (use_cached_result(ctx, &t, hash, cells)) {
+            print_summary(ctx->out, ctx->config, p->size,
+                          ctx->num_solutions, false);
+            ctx->init = NULL;
+            ctx->solution = NULL;
+            return ctx->num_solutions;
+        }
+        ctx->first_solution = arena_alloc(&ctx->arena,
+                                          sizeof(int) * p->num_cells);
+    }
+
+    if (ctx->config->convert) {
+        // Print the puzzle itself, as if it were its only solution.
+        report_solution(ctx);
+    } else {
+        run_engine(ctx, p);
+    }
+    if (use_cache) {
+        // An interrupted search says nothing about the puzzle.
+        if (!ctx->interrupted)
+            cache_result(ctx, &t, hash, cells);
+        ctx->first_solution = NULL;
+    }
+    if (!ctx->config->convert)
+        print_summary(ctx->out, ctx->config, p->size, ctx->num_solutions,
+                      ctx->interrupted);
+
+    ctx->init = NULL;
+    ctx->solution = NULL;
+    return ctx->num_solutions;
+}
+
+// Solves the --exact-cover problem whose pristine matrix is image, printing
+// the results to ctx->out. Returns the number of solutions found.
+// ctx->interrupted says whether the search finished.
+uint64_t solve_cover(SolverContext* ctx, const DLXMatrix* image) {
+    ctx->num_solutions = 0;
+    ctx->stop = false;
+    start_deadline(ctx);
+    if (ctx->config->stats)
+        ctx->stats = (SolverStats) { .phase_start = monotonic_seconds() };
+    DLXMatrix* m = get_image_matrix(&ctx->matrices, image);
+    ctx->matrix = m;
+    ctx->cover_rows = arena_alloc(&ctx->arena, sizeof(int) * m->max_depth);
+    end_stats_phase(ctx, &ctx->stats.setup_seconds);
+    dlx_solve(ctx);
+    end_stats_phase(ctx, &ctx->stats.search_seconds);
+    print_summary(ctx->out, ctx->config, 0, ctx->num_solutions,
+                  ctx->interrupted);
+    ctx->cover_rows = NULL;
+    return ctx->num_solutions;
+}
+
+// Puts the rows of each column of m, which must have nothing covered, in a
+// random order, which is the order that the search tries them in. rows has
+// room for m->max_row_count of them.
+static void shuffle_rows(DLXMatrix* m, DLXNode* rows, uint64_t* rng) {
+    for (DLXNode c = 1; c <= (DLXNode) m->num_columns; c++) {
+        int n = 0;
+        for (DLXNode i = m->down[c]; i != c; i = m->down[i])
+            rows[n++] = i;
+        for (int i = n - 1; i > 0; i--) {
+            int j = next_random(rng) % (i + 1);
+            DLXNode t = rows[i];
+            rows[i] = rows[j];
+            rows[j] = t;
+        }
+        DLXNode above = c;
+        for (int i = 0; i < n; i++) {
+            m->down[above] = rows[i];
+            m->up[rows[i]] = above;
+            above = rows[i];
+        }
+        m->down[above] = c;
+        m->up[c] = above;
+    }
+}
+
+// Fills in p, whose cells must all be empty, with a puzzle that has exactly
+// one solution, and would have more without any one of its givens. dlx finds
+// a random solution, trying the rows of each column in a random order, and
+// then each given in turn, in a random order, is removed if the puzzle is
+// still unique without it. The randomness comes only from ctx->config->seed
+// and index, so each puzzle is the same however the work is shared out. The
+// givens are placed and removed by editing the full matrix in place, so
+// --matrix does not apply; sizes are limited to kMaxGenerateSize, for which
+// it is small.
+void generate_puzzle(SolverContext* ctx, Puzzle* p, uint64_t index) {
+    // Every search stops at its first solution, and prints nothing.
+    ProgramConfig config = *ctx->config;
+    config.max_solutions = 1;
+    config.stats = false;
+    const ProgramConfig* saved_config = ctx->config;
+    SolutionCallback saved_callback = ctx->callback;
+    ctx->config = &config;
+    ctx->callback = NULL;
+
+    uint64_t rng = mix_bits(config.seed ^ mix_bits(index));
+    DLXMatrix* m = get_matrix(&ctx->matrices, p->size);
+    ctx->matrix = m;
+    DLXNode* rows = arena_alloc(&ctx->arena,
+                                sizeof(DLXNode) * m->max_row_count);
+    shuffle_rows(m, rows, &rng);
+    Puzzle solution;
+    copy_puzzle(&solution, p, &ctx->arena);
+    ctx->init = p;
+    ctx->solution = &solution;
+    ctx->num_solutions = 0;
+    ctx->stop = false;
+    ctx->first_solution = p->cells[0];
+    dlx_solve(ctx);
+    ctx->first_solution = NULL;
+
+    // Cover the givens in a random order, then try removing them in the
+    // reverse of it, so that the one to try next is always the last covered
+    // but for those that have had to stay, which go back on the top.
+    int n = p->num_cells;
+    int* order = arena_alloc(&ctx->arena, sizeof(int) * n);
+    for (int i = 0; i < n; i++) {
+        int j = next_random(&rng) % (i + 1);
+        order[i] = order[j];
+        order[j] = i;
+    }
+    DLXNode* placed = arena_alloc(&ctx->arena, sizeof(DLXNode) * n);
+    for (int i = 0; i < n; i++) {
+        int cell = order[n - 1 - i];
+        placed[i] = choice_row(m, p->size * cell + p->cells[0][cell] - 1);
+        cover_row(m, placed[i]);
+    }
+    int num_placed = n, num_kept = 0;
+    for (int k = 0; k < n; k++) {
+        int i = num_placed - 1 - num_kept;
+        DLXNode r = placed[i];
+        for (int j = num_placed - 1; j >= i; j--)
+            uncover_row(m, placed[j]);
+        for (int j = i; j < num_placed - 1; j++) {
+            placed[j] = placed[j + 1];
+            cover_row(m, placed[j]);
+        }
+        num_placed--;
+        // The puzzle was unique with the given, so any other solution
+        // without it has a different value in its cell.
+        hide_row(m, r);
+        ctx->num_solutions = 0;
+        ctx->stop = false;
+        dlx_solve(ctx);
+        unhide_row(m, r);
+        if (ctx->num_solutions == 0) {
+            p->cells[0][order[k]] = 0;
+        } else {
+            cover_row(m, r);
+            placed[num_placed++] = r;
+            num_kept++;
+        }
+    }
+
+    reset_matrix(m);
+    ctx->init = NULL;
+    ctx->solution = NULL;
+    ctx->config = saved_config;
+    ctx->callback = saved_callback;
+}
+
+static void add_split_task(SplitTaskList* list, const DLXNode* path,
+                           int path_len) {
+    if (list->num_tasks == list->max_tasks) {
+        list->max_tasks = list->max_tasks ? 2 * list->max_tasks : 64;
+        list->tasks = realloc(list->tasks,
+                              sizeof(SplitTask) * list->max_tasks);
+        list->paths = realloc(list->paths,
+                              sizeof(DLXNode) * list->max_tasks * list->depth);
+        if (!list->tasks || !list->paths)
+            fatal("out of memory");
+    }
+    list->tasks[list->num_tasks] = (SplitTask) { .path_len = path_len };
+    memcpy(list->paths + list->num_tasks * list->depth, path,
+           sizeof(DLXNode) * path_len);
+    list->num_tasks++;
+}
+
+// Walks the top of the search tree in the order dlx_solve() would, adding a
+// task for each path that reaches list->depth or a solution. Forced moves
+// take up a level each here, rather than being made all at once.
+void collect_split_tasks(DLXMatrix* m, SplitTaskList* list,
+                         DLXNode* path, int depth) {
+    if (m->right[0] == 0 || depth == list->depth) {
+        if (m->right[0] != 0)
+            list->truncated = true;
+        add_split_task(list, path, depth);
+        return;
+    }
+
+    DLXNode c = choose_column(m, 0);
+    cover_column(m, c);
+    for (DLXNode r = m->down[c]; r != c; r = m->down[r]) {
+        path[depth] = r;
+        for (DLXNode j = m->right[r]; j != r; j = m->right[j])
+            cover_column(m, m->column[j]);
+        collect_split_tasks(m, list, path, depth + 1);
+        for (DLXNode j = m->left[r]; j != r; j = m->left[j])
+            uncover_column(m, m->column[j]);
+    }
+    uncover_column(m, c);
+}
+
+// For --shard-depth, prints the subproblems of p's search at
+// config->shard_depth, just as solve_split() would find them: each is p with
+// the values chosen on the way down to one subtree filled in, so every
+// solution of p is a solution of exactly one of them. Returns the number
+// printed.
+uint64_t write_shards(SolverContext* ctx, Puzzle* p) {
+    DLXMatrix* m = get_puzzle_matrix(ctx, p);
+    Puzzle shard;
+    copy_puzzle(&shard, p, &ctx->arena);
+    ctx->matrix = m;
+    ctx->init = p;
+    ctx->solution = &shard;
+    ctx->num_solutions = 0;
+    ctx->stop = false;
+    if (cover_givens(m, p)) {
+        // No path is longer than the number of cells.
+        int depth = ctx->config->shard_depth < p->num_cells ?
+                    ctx->config->shard_depth : p->num_cells;
+        DLXNode* path = xmalloc(sizeof(DLXNode) * depth);
+        SplitTaskList list = { .depth = depth };
+        collect_split_tasks(m, &list, path, 0);
+        free(path);
+        for (int i = 0; i < list.num_tasks && !ctx->stop; i++) {
+            memcpy(shard.cells[0], p->cells[0], sizeof(int) * p->num_cells);
+            for (int j = 0; j < list.tasks[i].path_len; j++)
+                record_choice(ctx, list.paths[i * depth + j]);
+            report_solution(ctx);
+        }
+        free(list.tasks);
+        free(list.paths);
+    }
+    put_puzzle_matrix(ctx, m, p);
+    ctx->init = NULL;
+    ctx->solution = NULL;
+    return ctx->num_solutions;
+}
+
+void read_error(const char* path, PuzzleReader* r, bool batch, uint64_t index) {
+    const char* error_str = r->error ? strerror(r->error) :
+        "incorrect puzzle format";
+    if (batch)
+        fatal("error reading %s (puzzle %" PRIu64 "): %s", path, index + 1,
+              error_str);
+    fatal("error reading %s: %s", path, error_str);
+}
+
+// Parses a command-line argument that should be a number of at least min.
+uint64_t parse_count(const char* arg, uint64_t min, const char* what) {
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (!isdigit((unsigned char) *arg) || *end != '\0' || n < min ||
+        errno == ERANGE)
+        fatal("invalid %s: %s", what, arg);
+    return n;
+}
@@ -0,0 +1,566 @@
+// Copyright 2014 Philip Puryear
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The solver's internals, shared by sudoku, sudoku-bench and libsudokudlx.
+// This is not an installed header; the library's API is in sudokudlx.h.
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+typedef struct {
+    int** cells;
+    int size, num_cells;
+    // The variant's extra rules: whether each of the two main diagonals must
+    // also hold every value once, and for a jigsaw puzzle, the region (from 0
+    // to size - 1) of each cell, which take the place of the boxes, or NULL.
+    bool diagonal;
+    int* regions;
+} Puzzle;
+
+// The input that puzzles are read from. A regular file is mapped in whole;
+// anything else is read a block at a time into buf, which then holds the
+// unread input in [pos, len).
+typedef struct {
+    int fd;
+    char* buf;
+    size_t pos, len;
+    // The size of buf, or 0 if the file is mapped.
+    size_t buf_size;
+    // Set once buf holds the rest of the input.
+    bool eof;
+    // The errno value of a failed read, or 0.
+    int error;
+    // Set once the start of the input has been checked for a packed header.
+    bool started;
+    // For packed input, the size of its puzzles (or else 0), and the number
+    // of puzzles left to read.
+    int packed_size;
+    uint64_t packed_left;
+} PuzzleReader;
+
+// Where --packed output's header was written.
+typedef struct {
+    // The puzzle size in the header, or 0 until the header has been written.
+    int size;
+    // The header's position in the output file, or -1 if the file cannot be
+    // seeked, in which case the header's count is left unknown.
+    off_t header_pos;
+} PackedOutput;
+
+// Output that is built up in memory, then written to fd with as few calls to
+// write() as possible. If fd is -1, everything is kept until the buffer is
+// reset, so that it can be printed later on.
+typedef struct {
+    char* data;
+    size_t len, size;
+    int fd;
+} OutputBuffer;
+
+// Memory that is handed out in order, then all given back at once by
+// reset_arena(). Each block is mapped separately, with its header at the
+// start.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size, used;
+} ArenaBlock;
+
+typedef struct {
+    // The block being allocated from, followed by any that filled up since
+    // the last reset.
+    ArenaBlock* blocks;
+} Arena;
+
+// Nodes in the DLX matrix are referred to by their index. Node 0 is the root,
+// nodes 1 through num_columns are the column headers, and the rest make up
+// the rows.
+typedef uint32_t DLXNode;
+
+// Where each level of dlx_solve()'s search starts in the matrix's pending and
+// forced lists, so that it can go back to them.
+typedef struct {
+    // Propagation scans pending from scan_start on, and each row tried in
+    // the level's column starts with num_pending columns pending.
+    int scan_start, num_pending;
+    int num_forced;
+} DLXLevel;
+
+// The DLX matrix is stored as a struct of arrays, each indexed by node.
+typedef struct DLXMatrix {
+    // The puzzle size, or 0 for an --exact-cover matrix.
+    int size;
+    int num_columns;
+    // Columns 1 through num_primary must each be covered by a solution. The
+    // rest are secondary: covered at most once, and never linked in to the
+    // root's list, so the search never branches on them.
+    int num_primary;
+    // The most rows that any column has, and that any solution has.
+    int max_row_count, max_depth;
+    size_t num_nodes;
+    DLXNode *left, *right, *up, *down;
+    // The column header of each node.
+    DLXNode* column;
+    // The number of rows in each column, indexed by column header.
+    int* row_count;
+    // The row for choice i (i.e. placing value i % size + 1 in cell
+    // i / size) is the 4 nodes starting at first_row + 4 * i. For a variant
+    // or an --exact-cover matrix, row i is instead the nodes from
+    // row_start[i] up to row_start[i + 1], which the copies share with the
+    // image.
+    DLXNode first_row;
+    const DLXNode* row_start;
+    int num_rows;
+    // For a matrix pruned to a puzzle, which has rows for only some of the
+    // choices, the choice of each row, or NULL otherwise.
+    const int* row_choices;
+    // The row being tried at each level of dlx_solve()'s search. Each level
+    // covers a primary column, so max_depth levels are always enough.
+    DLXNode* stack;
+    DLXLevel* levels;
+    // The columns that the search has left with at most one row, to be
+    // checked by dlx_propagate(). Row counts only fall on the way down the
+    // search tree, so each column is added at most twice.
+    DLXNode* pending;
+    int num_pending;
+    // The rows that dlx_propagate() has covered, in order.
+    DLXNode* forced;
+    int num_forced;
+    // For CHOOSER_BUCKETS, the uncovered columns with k rows are the set
+    // bits of the bucket_words words from bucket_bits + k * bucket_words,
+    // each indexed by column header. Bit i of the words from
+    // bucket_summary + k * summary_words is set if word i of that bucket is
+    // nonzero.
+    uint64_t *bucket_bits, *bucket_summary;
+    int bucket_words, summary_words;
+    // The pristine matrix this one was copied from. The nodes are indices,
+    // so copying them needs no fixing up, and since covering never changes
+    // column the copies all share the image's.
+    const struct DLXMatrix* image;
+    struct DLXMatrix* next;
+} DLXMatrix;
+
+// A point in dlx_search()'s search, from which it can carry on: the row tried
+// at each level on the way down from the root, as an offset from first_row,
+// the last of which is the next to be tried, and the number of solutions
+// found before it.
+typedef struct {
+    uint32_t* path;
+    int path_len;
+    uint64_t num_solutions;
+} DLXPosition;
+
+// Called with the cells of each solution, which are the engine's own and must
+// not be changed. Returning nonzero stops the search.
+typedef int (*SolutionCallback)(void* data, const int* cells);
+
+// A set of values, with bit v - 1 standing for value v.
+typedef uint32_t BitboardMask;
+
+struct Bitboard;
+
+// Computes the candidates of every cell into b->cand, with none for the
+// filled cells. Returns the smallest (number of candidates << 16 | cell) over
+// the empty cells, or UINT32_MAX if there are none.
+typedef uint32_t (*BitboardScanFunc)(struct Bitboard* b);
+
+// Works out from b->cand which values have exactly one place left in each
+// unit, writing them to b->hidden. Returns false if some value has no place
+// left at all.
+typedef bool (*BitboardHiddenFunc)(struct Bitboard* b);
+
+// The state of the bitboard engine for one puzzle size.
+typedef struct Bitboard {
+    int size;
+    int block_size;
+    int num_cells;
+    BitboardMask all_values;
+    // The vectorized scans for this CPU, or NULL if the scalar search is
+    // faster.
+    BitboardScanFunc scan;
+    BitboardHiddenFunc find_hidden;
+    // The row, column and block containing each cell.
+    uint8_t *cell_row, *cell_col, *cell_block;
+    // unit_cells[u * size + i] is cell i of unit u. Units 0 through size - 1
+    // are the rows, followed by the columns and then the blocks.
+    uint16_t* unit_cells;
+    // The values placed so far in each unit, indexed by unit: unit_used is
+    // row_used, and col_used and block_used follow on from it.
+    BitboardMask *unit_used, *row_used, *col_used, *block_used;
+    // Scratch space for the vectorized scans, all padded so that they can be
+    // read a whole vector at a time: the values placed in the block containing
+    // each cell of a row, the candidates of each cell, and the hidden singles
+    // of each unit.
+    BitboardMask *band_used, *cand, *hidden;
+    // The value of each cell, or 0 if it is still empty.
+    uint8_t* cells;
+    // The empty cells are empty_cells[0] through empty_cells[num_empty - 1],
+    // and empty_pos gives each cell's position in that list.
+    uint16_t *empty_cells, *empty_pos;
+    int num_empty;
+    // The cells filled in so far, in order, so that they can be cleared on
+    // backtracking.
+    uint16_t* trail;
+    int trail_len;
+    struct Bitboard* next;
+} Bitboard;
+
+typedef enum {
+    ENGINE_AUTO,
+    ENGINE_DLX,
+    ENGINE_BITBOARD
+} Engine;
+
+// How dlx_search() picks the column to branch on.
+typedef enum {
+    // Scan the column headers for the one with the fewest rows.
+    CHOOSER_SCAN,
+    // Keep the columns in buckets by their number of rows, and take the first
+    // from the lowest bucket that has any. This picks the same column as the
+    // scan does.
+    CHOOSER_BUCKETS
+} ColumnChooser;
+
+// What dlx searches for each puzzle.
+typedef enum {
+    // MATRIX_PRUNED for puzzles from kMinPrunedSize up, MATRIX_FULL below.
+    MATRIX_AUTO,
+    // A copy of the matrix for the puzzle's size, with a row for every
+    // choice, whose givens are then covered.
+    MATRIX_FULL,
+    // A matrix built for the puzzle, with rows only for the choices that
+    // its givens leave open.
+    MATRIX_PRUNED
+} MatrixMode;
+
+// A symmetry of the grid that maps a puzzle onto its canonical form: cell
+// (i, j) of the canonical puzzle is cell (rows[i], cols[j]) of the original,
+// or cell (cols[j], rows[i]) if transpose is set, with each value v replaced
+// by values[v]. inverse undoes values.
+typedef struct {
+    int* rows;
+    int* cols;
+    int* values;
+    int* inverse;
+    bool transpose;
+} PuzzleTransform;
+
+// A puzzle's result, as remembered by the cache. The canonical givens come
+// first in cells, followed by the canonical solution if there is one.
+typedef struct CacheEntry {
+    uint64_t hash;
+    // The next entry in the same hash bucket.
+    struct CacheEntry* next;
+    // The entries used just before and just after this one.
+    struct CacheEntry *older, *newer;
+    int size;
+    uint64_t num_solutions;
+    // Whether num_solutions is the exact number, rather than the limit at
+    // which the search stopped.
+    bool complete;
+    // Whether the puzzle's only solution is in cells.
+    bool has_solution;
+    uint16_t cells[];
+} CacheEntry;
+
+// The results of the puzzles solved so far, keyed by their canonical forms
+// and shared by every thread. The least recently used are dropped to keep
+// the entries within max_bytes.
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry** buckets;
+    size_t num_buckets, num_entries;
+    CacheEntry *newest, *oldest;
+    size_t bytes, max_bytes;
+    // If the cache is kept in a file, the entries to be appended to it.
+    OutputBuffer log;
+} ResultCache;
+
+// What the search for a puzzle did, as counted for --stats.
+typedef struct {
+    // The branches tried, and how many of them led straight to a
+    // contradiction.
+    uint64_t nodes, backtracks;
+    // The deepest level of the search tree reached, and the current one.
+    int max_depth, depth;
+    // Counted only by the dlx engine: the columns covered by the search, and
+    // the links that those covers removed.
+    uint64_t covers, links;
+    // The time spent getting the matrix or bitboard ready for the puzzle
+    // (building it first if need be) and restoring it afterwards, and the
+    // time spent searching.
+    double setup_seconds, search_seconds;
+    double phase_start;
+} SolverStats;
+
+typedef struct {
+    bool print_solutions;
+    bool print_num_solutions;
+    bool batch;
+    Engine engine;
+    ColumnChooser chooser;
+    MatrixMode matrix;
+    int num_threads;
+    // The depth to which the search tree is split up when solving a single
+    // puzzle on several threads, or 0 to pick one automatically.
+    int split_depth;
+    // The search stops once it has found this many solutions.
+    uint64_t max_solutions;
+    // Set by --unique, which makes the exit status say whether each puzzle
+    // has exactly one solution.
+    bool unique;
+    // Print each solution on one line rather than as a grid.
+    bool one_line;
+    // Highlight the cells that were filled in by the solver.
+    bool highlight;
+    // Write solutions in the packed format rather than as text.
+    bool packed;
+    // In batch mode, the number of puzzles to skip at the start of the input,
+    // and the most to read after that.
+    uint64_t skip, count;
+    // Print the puzzles as they are, rather than solving them.
+    bool convert;
+    // The results of the puzzles solved so far, or NULL to solve every puzzle
+    // from scratch.
+    ResultCache* cache;
+    // Count what each search does, and print it for --stats.
+    bool stats;
+    // The most seconds that the search for each puzzle may take, or 0 for no
+    // limit.
+    double timeout;
+    // Where the search is saved if it is stopped before it finishes, and
+    // where it is carried on from, or NULL. Either makes the search use dlx.
+    const char* checkpoint_path;
+    const char* resume_path;
+    // Print the subproblems that the search splits into at this depth,
+    // rather than solving the puzzles, or 0 to solve them.
+    int shard_depth;
+    // The input is an exact cover problem (see read_cover_matrix()) rather
+    // than puzzles.
+    bool exact_cover;
+    // For --generate, the size of the puzzles to make (see
+    // generate_puzzle()) rather than reading any, or 0, and the seed that
+    // they are made from.
+    int generate;
+    uint64_t seed;
+} ProgramConfig;
+
+// All of the state needed to solve puzzles. Each thread owns its own context,
+// so any number of solves can run at once.
+typedef struct {
+    const ProgramConfig* config;
+    // The matrices built so far, one per puzzle size.
+    DLXMatrix* matrices;
+    DLXMatrix* matrix;
+    // Likewise for the bitboard engine.
+    Bitboard* bitboards;
+    // Holds the copies of the puzzle being solved. Whoever calls
+    // solve_puzzle() resets it between puzzles.
+    Arena arena;
+    const Puzzle* init;
+    Puzzle* solution;
+    // For an --exact-cover matrix, which has no puzzle, the solution is
+    // instead the numbers of its rows (counting from 1).
+    int* cover_rows;
+    int num_cover_rows;
+    // The rows covered before the search started, which belong to every
+    // solution it finds, such as a split task's path.
+    const DLXNode* base_rows;
+    int num_base_rows;
+    uint64_t num_solutions;
+    // In split mode, the number of solutions found by all of the workers
+    // together, or NULL otherwise.
+    uint64_t* shared_solutions;
+    // Set once config->max_solutions have been found, to make the search
+    // unwind.
+    bool stop;
+    OutputBuffer* out;
+    // When the cache is in use, the first solution found is copied here.
+    int* first_solution;
+    // When config->stats is set, what solving the current puzzle took.
+    SolverStats stats;
+    // What is done with each solution: by default, print_solution() with the
+    // context as its data, or nothing if only the solutions are counted.
+    SolutionCallback callback;
+    void* callback_data;
+    // When the search must stop by (on the monotonic_seconds() clock), or 0
+    // if it has all the time it needs, and a flag that stops it when set from
+    // elsewhere, or NULL. The search checks them when poll_countdown, which
+    // it decrements for each node, reaches 0. interrupted is set if either
+    // stopped it.
+    double deadline;
+    const volatile sig_atomic_t* cancel;
+    int poll_countdown;
+    bool interrupted;
+    // For the dlx engine, the position to carry the search on from, and where
+    // to save the position if the search is interrupted, or NULL.
+    const DLXPosition* resume;
+    DLXPosition* checkpoint;
+} SolverContext;
+
+// A subtree of the search for a single puzzle. Its path is the list of row
+// nodes chosen on the way down from the root.
+typedef struct {
+    int path_len;
+    uint64_t num_solutions;
+    // As for BatchJob, in sudoku.c.
+    const OutputBuffer* output;
+    size_t output_start, output_len;
+} SplitTask;
+
+typedef struct {
+    SplitTask* tasks;
+    int num_tasks, max_tasks;
+    // Task i's path starts at paths[i * depth].
+    DLXNode* paths;
+    int depth;
+    // Set if some path was cut off at depth before reaching a solution or a
+    // dead end.
+    bool truncated;
+} SplitTaskList;
+
+static const int kMaxPuzzleSize = 256;
+// The size of each block read from inputs that cannot be mapped.
+static const size_t kReadBlockSize = 1 << 16;
+// The largest puzzle size whose values fit in a BitboardMask.
+static const int kMaxBitboardSize = 25;
+// The smallest puzzles that MATRIX_AUTO prunes the matrix for. The full
+// matrix has size^3 rows, so from here up it takes tens of megabytes or more
+// to copy and reset for every puzzle, however many of its cells are given.
+static const int kMinPrunedSize = 64;
+// The largest puzzles that --generate makes. Its first search fills an empty
+// grid and each later one proves a puzzle unique, which from 25x25 up can
+// take minutes or longer.
+static const int kMaxGenerateSize = 16;
+
+static inline uint64_t load_le(const char* p, int n) {
+    uint64_t x = 0;
+    for (int i = n - 1; i >= 0; i--)
+        x = x << 8 | (uint8_t) p[i];
+    return x;
+}
+
+static inline void store_le(char* p, uint64_t x, int n) {
+    for (int i = 0; i < n; i++, x >>= 8)
+        p[i] = x;
+}
+
+// Whether p has rules beyond those of plain sudoku, which only dlx knows.
+static inline bool is_variant(const Puzzle* p) {
+    return p->diagonal || p->regions;
+}
+
+// Whether solutions and puzzles are separated by blank lines in the output.
+static inline bool blank_line_between(const ProgramConfig* config) {
+    return config->print_solutions && !config->one_line && !config->packed &&
+           !config->exact_cover;
+}
+
+static inline bool issquare(int x) {
+    int s = sqrt(x);
+    return s * s == x;
+}
+
+// Mixes the bits of x, for hashing.
+static inline uint64_t mix_bits(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111eb;
+    return x ^ x >> 31;
+}
+
+// Errors and memory.
+void fatal(const char* msg, ...);
+void* xmalloc(size_t n);
+void init_arena(Arena* a);
+void* arena_alloc(Arena* a, size_t n);
+void reset_arena(Arena* a);
+void free_arena(Arena* a);
+
+// Output.
+void init_output(OutputBuffer* o, int fd);
+void flush_output(OutputBuffer* o);
+void free_output(OutputBuffer* o);
+char* reserve_output(OutputBuffer* o, size_t n);
+void commit_output(OutputBuffer* o, char* end);
+void append_output(OutputBuffer* o, const char* s, size_t n);
+void start_packed_puzzle(PackedOutput* po, OutputBuffer* out, const Puzzle* p);
+void finish_packed_output(PackedOutput* po, OutputBuffer* out);
+void print_summary(OutputBuffer* out, const ProgramConfig* config,
+                   int size, uint64_t num_solutions, bool interrupted);
+
+// Puzzles and the result cache.
+void init_puzzle(Puzzle* p, int size, Arena* arena);
+void copy_puzzle(Puzzle* a, const Puzzle* b, Arena* arena);
+void init_cache(ResultCache* c, size_t max_bytes);
+char* read_whole_file(int fd, const char* path, size_t* len);
+void load_cache(ResultCache* c, const char* path);
+void flush_cache(ResultCache* c);
+void free_cache(ResultCache* c);
+
+// Reading puzzles.
+bool open_reader(PuzzleReader* r, const char* path);
+void close_reader(PuzzleReader* r);
+bool at_end_of_input(PuzzleReader* r);
+int read_puzzle(Puzzle* puzzle, PuzzleReader* r, Arena* arena);
+int skip_puzzles(PuzzleReader* r, uint64_t n);
+void read_error(const char* path, PuzzleReader* r, bool batch, uint64_t index);
+uint64_t parse_count(const char* arg, uint64_t min, const char* what);
+
+// Exact cover matrices.
+void cover_row(DLXMatrix* m, DLXNode r);
+void uncover_row(DLXMatrix* m, DLXNode r);
+void read_cover_matrix(DLXMatrix* m, const char* path);
+void free_matrix_image(DLXMatrix* m);
+bool is_row_free(DLXMatrix* m, DLXNode r);
+void copy_matrix_state(DLXMatrix* m, const DLXMatrix* from);
+const DLXMatrix* get_matrix_image(int size);
+void free_matrix_images(void);
+DLXMatrix* get_image_matrix(DLXMatrix** cache, const DLXMatrix* image);
+DLXMatrix* get_matrix(DLXMatrix** cache, int size);
+bool cover_givens(DLXMatrix* m, const Puzzle* p);
+bool use_pruned_matrix(const ProgramConfig* config, const Puzzle* p);
+bool has_own_matrix(const ProgramConfig* config, const Puzzle* p);
+DLXMatrix* new_puzzle_image(const ProgramConfig* config, const Puzzle* p);
+void free_puzzle_image(DLXMatrix* image);
+Bitboard* get_bitboard(Bitboard** cache, int size);
+
+// Solving.
+double monotonic_seconds(void);
+void dlx_solve(SolverContext* ctx);
+void init_solver(SolverContext* ctx, const ProgramConfig* config);
+void destroy_solver(SolverContext* ctx);
+void end_stats_phase(SolverContext* ctx, double* phase);
+void run_engine(SolverContext* ctx, const Puzzle* p);
+void start_deadline(SolverContext* ctx);
+bool poll_budget(SolverContext* ctx);
+uint64_t solve_puzzle(SolverContext* ctx, Puzzle* p);
+uint64_t solve_cover(SolverContext* ctx, const DLXMatrix* image);
+void generate_puzzle(SolverContext* ctx, Puzzle* p, uint64_t index);
+void collect_split_tasks(DLXMatrix* m, SplitTaskList* list,
+                         DLXNode* path, int depth);
+uint64_t write_shards(SolverContext* ctx, Puzzle* p);
+
+#endif  // SOLVER_H
@@ -12,388 +12,1353 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#define _GNU_SOURCE
+
+#include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
-#include <math.h>
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define HAVE_EPOLL 1
+#endif
 
-typedef struct {
-    int** cells;
-    int size, num_cells;
-} Puzzle;
+#include "solver.h"
 
-typedef struct DLXObject {
-    struct DLXObject *left, *right, *up, *down, *column;
-    void* data;
-} DLXObject;
+// A puzzle read in batch mode, along with the output of solving it, which is
+// the output_len bytes from output_start in the buffer output.
+typedef struct {
+    Puzzle puzzle;
+    uint64_t num_solutions;
+    bool interrupted;
+    SolverStats stats;
+    const OutputBuffer* output;
+    size_t output_start, output_len;
+} BatchJob;
 
 typedef struct {
-    int row, column, value;
-} DLXRowData;
+    BatchJob* jobs;
+    int num_jobs;
+    // Holds the jobs' puzzles.
+    Arena arena;
+    // The index of the next job to be claimed by a worker.
+    int next_job;
+    // The position of the first job in the whole batch.
+    uint64_t index;
+} BatchQueue;
 
 typedef struct {
-    int row_count;
-} DLXColumnData;
+    SolverContext ctx;
+    // Collects the output of all of the worker's jobs.
+    OutputBuffer output;
+    BatchQueue* queue;
+    pthread_t thread;
+} BatchWorker;
 
+struct SplitPool;
+
+// The tasks in [head, tail) are waiting to be run. The owning worker takes
+// tasks from the head, while idle workers steal from the tail.
 typedef struct {
-    bool print_solutions;
-    bool print_num_solutions;
-} ProgramConfig;
+    pthread_mutex_t lock;
+    int head, tail;
+} SplitDeque;
 
 typedef struct {
-    DLXObject* header;
-    Puzzle* init;
-    Puzzle* solution;
+    SolverContext ctx;
+    OutputBuffer output;
+    struct SplitPool* pool;
+    SplitDeque deque;
+    pthread_t thread;
+} SplitWorker;
+
+typedef struct SplitPool {
+    SplitTaskList* list;
+    // The puzzle, or NULL for --exact-cover.
+    const Puzzle* puzzle;
+    // The puzzle's matrix with its givens covered, which each worker copies.
+    const DLXMatrix* matrix;
     uint64_t num_solutions;
-} DLXParameters;
-
-static const int kMaxPuzzleSize = 256;
-static ProgramConfig config = {
-    .print_solutions = true,
-    .print_num_solutions = false
-};
-static DLXParameters dlx_params;
-
-static void fatal(const char* msg, ...) {
-    va_list ap;
-    fprintf(stderr, "error: ");
-    va_start(ap, msg);
-    vfprintf(stderr, msg, ap);
-    va_end(ap);
-    fprintf(stderr, "\n");
-    exit(EXIT_FAILURE);
-}
-
-static void* xmalloc(size_t n) {
-    void* p = malloc(n);
-    if (!p)
-        fatal("out of memory");
-    return p;
-}
-
-static void print_puzzle(Puzzle* solution, Puzzle* init) {
-    int size = solution->size;
-    int block_size = sqrt(size);
-    int max_cell_width = 1 + (int) log10(size);
-    bool highlight_solved_cells = init && isatty(STDOUT_FILENO);
-    for (int i = 0; i < size; i++) {
-        if (i > 0 && i % block_size == 0) {
-            for (int j = 0; j < block_size; j++) {
-                if (j > 0)
-                    printf("-|-");
-                for (int k = 0; k < block_size * (1 + max_cell_width) - 1; k++)
-                    printf("-");
-            }
-            printf("\n");
-        }
+    SplitWorker* workers;
+    int num_workers;
+} SplitPool;
 
-        for (int j = 0; j < size; j++) {
-            if (j > 0) {
-                printf(" ");
-                if (j % block_size == 0)
-                    printf("| ");
-            }
+#ifdef HAVE_EPOLL
+// A request being solved in --serve mode.
+typedef struct ServeJob {
+    struct ServeConn* conn;
+    char* request;
+    size_t request_len;
+    // The reply, ready to be sent back with its frame header.
+    OutputBuffer reply;
+    struct ServeJob* next;
+} ServeJob;
 
-            int value = solution->cells[i][j];
-            if (value == 0)
-                printf(".");
-            else {
-                bool highlight_cell =
-                    highlight_solved_cells && init->cells[i][j] == 0;
-
-                if (highlight_cell)
-                    printf("\x1b[1;31m");
-                printf("%*d", max_cell_width, value);
-                if (highlight_cell)
-                    printf("\x1b[0m");
-            }
-        }
-        printf("\n");
-    }
+// A client connection in --serve mode. Requests are solved one at a time, so
+// that the replies go back in the same order.
+typedef struct ServeConn {
+    int fd;
+    // Bytes read from the client but not yet handled.
+    char* in;
+    size_t in_len, in_size;
+    // The replies waiting to be sent, from out_pos onwards.
+    OutputBuffer out;
+    size_t out_pos;
+    // Set while one of the connection's requests is being solved.
+    bool busy;
+    // Set once the client has finished sending.
+    bool eof;
+    // Set once the socket has been closed. The connection is freed once the
+    // request being solved for it (if any) is done and the event loop has
+    // finished with the events it had for it.
+    bool closed;
+    // The events that the event loop is waiting for on the socket, or 0 if
+    // it has been taken out of the epoll set.
+    uint32_t events;
+    // The next connection in the server's list of those to free.
+    struct ServeConn* next_closed;
+} ServeConn;
+
+typedef struct ServeServer {
+    const ProgramConfig* config;
+    int epoll_fd, listen_fd;
+    // An eventfd that the workers use to wake up the event loop.
+    int wake_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;
+    // The jobs waiting for a worker, and those done but not yet sent.
+    ServeJob *jobs_head, *jobs_tail, *done;
+    // The connections to free once the events that epoll_wait() returned
+    // have all been handled, since later ones may still be for them.
+    ServeConn* closed;
+} ServeServer;
+
+typedef struct {
+    SolverContext ctx;
+    OutputBuffer output;
+    ServeServer* server;
+    pthread_t thread;
+} ServeWorker;
+#endif
+
+// --serve's limit on the size of a single request.
+static const uint32_t kMaxServeRequestSize = 1 << 20;
+// The length, status and number of solutions that start each reply.
+static const size_t kServeReplyHeaderSize = 13;
+static const int kServeStatusOk = 0;
+static const int kServeStatusError = 1;
+static const int kServeStatusStopped = 2;
+// The default limit on the cache's memory, in MiB.
+static const uint64_t kDefaultCacheSize = 64;
+static const int kMaxThreads = 1024;
+// The number of puzzles read in per worker before the workers are started.
+static const int kJobsPerWorker = 256;
+// When splitting up the search for a single puzzle, the search tree is
+// expanded until there are about this many subtrees per worker...
+static const int kSplitTasksPerWorker = 16;
+// ...or this depth is reached.
+static const int kMaxSplitDepth = 24;
+// The exit statuses used by --unique, besides EXIT_SUCCESS for puzzles with
+// exactly one solution.
+static const int kExitNoSolutions = 2;
+static const int kExitMultipleSolutions = 3;
+// The exit status if --timeout or a signal stopped some puzzle's search.
+static const int kExitInterrupted = 4;
+// A --checkpoint file is a header (the magic number, the version, the puzzle
+// size, a byte that is 1 if the matrix was pruned to the puzzle and 0 if not,
+// the path length and the number of solutions found), the puzzle's
+// givens as 2-byte values, and the path as 4-byte offsets, all little-endian.
+static const char kCheckpointMagic[4] = { 'S', 'D', 'K', 'R' };
+static const int kCheckpointVersion = 1;
+static const size_t kCheckpointHeaderSize = 24;
+
+// Prints the --stats line for the puzzle with the given index in the input,
+// as a JSON object on standard error.
+static void print_stats(const SolverStats* s, uint64_t index, int size,
+                        uint64_t num_solutions) {
+    fprintf(stderr, "{\"puzzle\": %" PRIu64 ", \"size\": %d, "
+            "\"solutions\": %" PRIu64 ", \"nodes\": %" PRIu64 ", "
+            "\"backtracks\": %" PRIu64 ", \"max_depth\": %d, "
+            "\"covers\": %" PRIu64 ", \"links\": %" PRIu64 ", "
+            "\"setup_us\": %.1f, \"search_us\": %.1f}\n",
+            index + 1, size, num_solutions, s->nodes, s->backtracks,
+            s->max_depth, s->covers, s->links, s->setup_seconds * 1e6,
+            s->search_seconds * 1e6);
 }
 
-static void init_puzzle(Puzzle* p, int size) {
-    p->cells = xmalloc(sizeof(int*) * size);
-    int num_cells = size * size;
-    p->cells[0] = xmalloc(sizeof(int) * num_cells);
-    for (int i = 1; i < size; i++)
-        p->cells[i] = p->cells[i - 1] + size;
-    p->size = size;
-    p->num_cells = num_cells;
+// Merges a puzzle's result into the exit status, which says whether any
+// search was interrupted, and otherwise is as described for --unique.
+static void record_result(const ProgramConfig* config, int* status,
+                          uint64_t num_solutions, bool interrupted) {
+    if (interrupted)
+        *status = kExitInterrupted;
+    if (!config->unique || num_solutions == 1 || *status == kExitInterrupted)
+        return;
+    if (num_solutions > 1)
+        *status = kExitMultipleSolutions;
+    else if (*status != kExitMultipleSolutions)
+        *status = kExitNoSolutions;
 }
 
-static void copy_puzzle(Puzzle* a, Puzzle* b) {
-    init_puzzle(a, b->size);
-    memcpy(a->cells[0], b->cells[0], sizeof(int) * b->num_cells);
+static void* batch_worker_main(void* arg) {
+    BatchWorker* w = arg;
+    BatchQueue* q = w->queue;
+    for (;;) {
+        int i = __atomic_fetch_add(&q->next_job, 1, __ATOMIC_RELAXED);
+        if (i >= q->num_jobs)
+            break;
+
+        // Capture the output so that it can be printed in input order.
+        BatchJob* job = &q->jobs[i];
+        job->output = &w->output;
+        job->output_start = w->output.len;
+        const ProgramConfig* config = w->ctx.config;
+        if (config->generate)
+            generate_puzzle(&w->ctx, &job->puzzle,
+                            config->skip + q->index + i);
+        job->num_solutions = solve_puzzle(&w->ctx, &job->puzzle);
+        job->interrupted = w->ctx.interrupted;
+        job->stats = w->ctx.stats;
+        job->output_len = w->output.len - job->output_start;
+        reset_arena(&w->ctx.arena);
+    }
+    return NULL;
 }
 
-static void free_puzzle(Puzzle* puzzle) {
-    free(puzzle->cells[0]);
-    free(puzzle->cells);
+// Solves every job in q using the given workers, then prints the results to
+// out in order. index is the position of q's first job in the whole batch,
+// and status is updated as for record_result().
+static void run_batch_jobs(BatchQueue* q, BatchWorker* workers,
+                           int num_workers, uint64_t index, OutputBuffer* out,
+                           int* status) {
+    q->next_job = 0;
+    q->index = index;
+    if (q->num_jobs < num_workers)
+        num_workers = q->num_jobs;
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].queue = q;
+        int err = pthread_create(&workers[i].thread, NULL, batch_worker_main,
+                                 &workers[i]);
+        if (err != 0)
+            fatal("cannot create thread: %s", strerror(err));
+    }
+    for (int i = 0; i < num_workers; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    const ProgramConfig* config = workers[0].ctx.config;
+    for (int i = 0; i < q->num_jobs; i++) {
+        BatchJob* job = &q->jobs[i];
+        if (index + i > 0 && blank_line_between(config))
+            append_output(out, "\n", 1);
+        append_output(out, job->output->data + job->output_start,
+                      job->output_len);
+        record_result(config, status, job->num_solutions, job->interrupted);
+        if (config->stats)
+            print_stats(&job->stats, config->skip + index + i,
+                        job->puzzle.size, job->num_solutions);
+    }
+    for (int i = 0; i < num_workers; i++)
+        workers[i].output.len = 0;
+    reset_arena(&q->arena);
 }
 
-static inline bool issquare(int x) {
-    int s = sqrt(x);
-    return s * s == x;
+// Claims the next task for w to run, stealing one from another worker if w
+// has none left. Returns -1 once every task has been claimed.
+static int next_split_task(SplitWorker* w) {
+    SplitPool* pool = w->pool;
+    int index = w - pool->workers;
+    for (int i = 0; i < pool->num_workers; i++) {
+        SplitDeque* d = &pool->workers[(index + i) % pool->num_workers].deque;
+        int task = -1;
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail)
+            task = i == 0 ? d->head++ : --d->tail;
+        pthread_mutex_unlock(&d->lock);
+        if (task >= 0)
+            return task;
+    }
+    return -1;
 }
 
-static int read_puzzle(Puzzle* puzzle, FILE* in) {
-    bool read_size = false;
-    puzzle->cells = NULL;
-    int cell = 0;
-    while (!feof(in)) {
-        // Read in one field at a time, ignoring all whitespace.
-        // A field can never be longer than the maximum length of the
-        // decimal representation of an int (10 digits).
-        char buf[16];
-        // The trailing space is necessary to consume all trailing whitepace.
-        if (fscanf(in, "%15s ", buf) != 1)
-            goto err;
-        if (!read_size) {
-            // Interpret the first field as the puzzle size.
-            int size;
-            if (sscanf(buf, "%d", &size) != 1 || size < 1 ||
-                size > kMaxPuzzleSize || !issquare(size))
-                goto err;
+static void* split_worker_main(void* arg) {
+    SplitWorker* w = arg;
+    SolverContext* ctx = &w->ctx;
+    SplitTaskList* list = w->pool->list;
 
-            init_puzzle(puzzle, size);
-            read_size = true;
-            continue;
-        }
+    // Every worker searches its own copy of the puzzle's matrix.
+    const Puzzle* p = w->pool->puzzle;
+    DLXMatrix* m = get_image_matrix(&ctx->matrices, w->pool->matrix->image);
+    copy_matrix_state(m, w->pool->matrix);
+    Puzzle solution;
+    if (p) {
+        copy_puzzle(&solution, p, &ctx->arena);
+        ctx->init = p;
+        ctx->solution = &solution;
+    } else {
+        ctx->cover_rows = arena_alloc(&ctx->arena, sizeof(int) * m->max_depth);
+    }
+    ctx->matrix = m;
+    ctx->shared_solutions = &w->pool->num_solutions;
 
-        if (buf[strspn(buf, "-|")] == '\0')
-            continue;
-        if (cell >= puzzle->num_cells)
-            goto err;
-        int value;
-        if (strcmp(buf, ".") == 0)
-            value = 0;
-        else if (sscanf(buf, "%d", &value) != 1 ||
-                 value < 1 || value > puzzle->size)
-            goto err;
-        puzzle->cells[0][cell] = value;
-        cell++;
-    }
-    if (read_size && cell == puzzle->num_cells)
+    int i;
+    while ((i = next_split_task(w)) >= 0) {
+        // The tasks that are left can be skipped once every solution needed
+        // has been found, or the time is up.
+        if (__atomic_load_n(ctx->shared_solutions, __ATOMIC_RELAXED) >=
+            ctx->config->max_solutions || poll_budget(ctx))
+            break;
+        SplitTask* task = &list->tasks[i];
+        const DLXNode* path = list->paths + i * list->depth;
+        task->output = &w->output;
+        task->output_start = w->output.len;
+
+        ctx->num_solutions = 0;
+        ctx->stop = false;
+        for (int j = 0; j < task->path_len; j++)
+            cover_row(m, path[j]);
+        ctx->base_rows = path;
+        ctx->num_base_rows = task->path_len;
+        // The search starts below the task's path, so its depths are
+        // counted from there.
+        int max_depth = ctx->stats.max_depth;
+        ctx->stats.max_depth = 0;
+        dlx_solve(ctx);
+        if (ctx->stats.max_depth + task->path_len > max_depth)
+            max_depth = ctx->stats.max_depth + task->path_len;
+        ctx->stats.max_depth = max_depth;
+        for (int j = task->path_len - 1; j >= 0; j--)
+            uncover_row(m, path[j]);
+        task->num_solutions = ctx->num_solutions;
+        task->output_len = w->output.len - task->output_start;
+    }
+
+    ctx->init = NULL;
+    ctx->solution = NULL;
+    ctx->cover_rows = NULL;
+    return NULL;
+}
+
+// Solves p, whose pristine matrix is image, by splitting the top of its
+// search tree into subtrees, which are then searched by config->num_threads
+// worker threads. p is NULL for --exact-cover, where image is the whole
+// problem. The results are printed to out, and for --stats, what the workers
+// did between them is summed up in stats. Returns the number of solutions
+// found, setting *interrupted if the workers ran out of time before finding
+// them all.
+static uint64_t solve_split(const ProgramConfig* config,
+                            const DLXMatrix* image, Puzzle* p,
+                            OutputBuffer* out, SolverStats* stats,
+                            bool* interrupted) {
+    SolverContext ctx;
+    init_solver(&ctx, config);
+    start_deadline(&ctx);
+    *interrupted = false;
+    if (config->stats)
+        ctx.stats.phase_start = monotonic_seconds();
+    int size = p ? p->size : 0;
+    DLXMatrix* m = get_image_matrix(&ctx.matrices, image);
+    if (p && !cover_givens(m, p)) {
+        end_stats_phase(&ctx, &ctx.stats.setup_seconds);
+        *stats = ctx.stats;
+        destroy_solver(&ctx);
+        print_summary(out, config, size, 0, false);
         return 0;
-err:
-    if (puzzle->cells)
-        free_puzzle(puzzle);
-    return -1;
+    }
+
+    ctx.matrix = m;
+    int num_workers = config->num_threads;
+    DLXNode* path = xmalloc(sizeof(DLXNode) * kMaxSplitDepth);
+    SplitTaskList list = { .tasks = NULL, .paths = NULL };
+    // Unless told otherwise, deepen the split until there is plenty of work
+    // to go around.
+    int depth = config->split_depth ? config->split_depth : 1;
+    for (;; depth++) {
+        free(list.tasks);
+        free(list.paths);
+        list = (SplitTaskList) { .depth = depth };
+        collect_split_tasks(m, &list, path, 0);
+        if (config->split_depth || !list.truncated ||
+            list.num_tasks >= num_workers * kSplitTasksPerWorker ||
+            depth == kMaxSplitDepth)
+            break;
+    }
+    free(path);
+    end_stats_phase(&ctx, &ctx.stats.setup_seconds);
+
+    SplitPool pool = {
+        .list = &list,
+        .puzzle = p,
+        .matrix = m,
+        .num_solutions = 0,
+        .workers = xmalloc(sizeof(SplitWorker) * num_workers),
+        .num_workers = num_workers
+    };
+    for (int i = 0; i < num_workers; i++) {
+        SplitWorker* w = &pool.workers[i];
+        init_solver(&w->ctx, config);
+        init_output(&w->output, -1);
+        w->ctx.out = &w->output;
+        w->ctx.deadline = ctx.deadline;
+        w->pool = &pool;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        // Start each worker off with an equal share of the tasks.
+        w->deque.head = (int64_t) list.num_tasks * i / num_workers;
+        w->deque.tail = (int64_t) list.num_tasks * (i + 1) / num_workers;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        int err = pthread_create(&pool.workers[i].thread, NULL,
+                                 split_worker_main, &pool.workers[i]);
+        if (err != 0)
+            fatal("cannot create thread: %s", strerror(err));
+    }
+    for (int i = 0; i < num_workers; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+    end_stats_phase(&ctx, &ctx.stats.search_seconds);
+    for (int i = 0; i < num_workers; i++) {
+        const SolverStats* s = &pool.workers[i].ctx.stats;
+        ctx.stats.nodes += s->nodes;
+        ctx.stats.backtracks += s->backtracks;
+        if (s->max_depth > ctx.stats.max_depth)
+            ctx.stats.max_depth = s->max_depth;
+        ctx.stats.covers += s->covers;
+        ctx.stats.links += s->links;
+        if (pool.workers[i].ctx.interrupted)
+            *interrupted = true;
+    }
+    *stats = ctx.stats;
+    // The workers' copies are thrown away, as is this one, so there is no
+    // need to uncover any of them.
+    destroy_solver(&ctx);
+
+    // The tasks are in the order dlx_solve() would have visited them, so
+    // their solutions can simply be printed one after another.
+    uint64_t num_solutions = 0;
+    for (int i = 0; i < list.num_tasks; i++) {
+        SplitTask* task = &list.tasks[i];
+        if (num_solutions > 0 && task->num_solutions > 0 &&
+            blank_line_between(config))
+            append_output(out, "\n", 1);
+        // Tasks skipped after reaching config->max_solutions were never run.
+        if (task->output)
+            append_output(out, task->output->data + task->output_start,
+                          task->output_len);
+        num_solutions += task->num_solutions;
+    }
+    print_summary(out, config, size, num_solutions, *interrupted);
+
+    for (int i = 0; i < num_workers; i++) {
+        destroy_solver(&pool.workers[i].ctx);
+        free_output(&pool.workers[i].output);
+        pthread_mutex_destroy(&pool.workers[i].deque.lock);
+    }
+    free(pool.workers);
+    free(list.tasks);
+    free(list.paths);
+    return num_solutions;
 }
 
-static inline DLXColumnData* get_column_data(DLXObject* c) {
-    return (DLXColumnData*) c->data;
+// For --sum, prints the total of the whitespace-separated numbers of
+// solutions in the file at path, such as the output of -n for each of a
+// puzzle's shards.
+static void print_sum(const char* path) {
+    FILE* f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f)
+        fatal("cannot open %s: %s", path, strerror(errno));
+    uint64_t total = 0;
+    char word[32];
+    while (fscanf(f, "%31s", word) == 1) {
+        char* end;
+        errno = 0;
+        unsigned long long n = strtoull(word, &end, 10);
+        if (!isdigit((unsigned char) word[0]) || *end != '\0' ||
+            errno == ERANGE || strlen(word) == sizeof(word) - 1)
+            fatal("invalid number of solutions in %s: %s", path, word);
+        if (__builtin_add_overflow(total, n, &total))
+            fatal("the total is too large");
+    }
+    if (ferror(f))
+        fatal("cannot read %s: %s", path, strerror(errno));
+    if (f != stdin)
+        fclose(f);
+    printf("%" PRIu64 "\n", total);
 }
 
-static void cover_column(DLXObject* c) {
-    c->right->left = c->left;
-    c->left->right = c->right;
-    for (DLXObject* i = c->down; i != c; i = i->down) {
-        for (DLXObject* j = i->right; j != i; j = j->right) {
-            j->down->up = j->up;
-            j->up->down = j->down;
-            get_column_data(j->column)->row_count--;
-        }
+// Saves pos, the position reached in the search for p (whose matrix was
+// pruned if pruned is set), to the file at path. The new file replaces the
+// old one only once it is complete.
+static void write_checkpoint(const char* path, const Puzzle* p, bool pruned,
+                             const DLXPosition* pos) {
+    size_t path_len = strlen(path);
+    char* tmp_path = xmalloc(path_len + 5);
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        fatal("cannot create %s: %s", tmp_path, strerror(errno));
+    OutputBuffer out;
+    init_output(&out, fd);
+    char* h = reserve_output(&out, kCheckpointHeaderSize);
+    memset(h, 0, kCheckpointHeaderSize);
+    memcpy(h, kCheckpointMagic, sizeof(kCheckpointMagic));
+    store_le(h + 4, kCheckpointVersion, 4);
+    store_le(h + 8, p->size, 2);
+    store_le(h + 10, pruned, 1);
+    store_le(h + 12, pos->path_len, 4);
+    store_le(h + 16, pos->num_solutions, 8);
+    commit_output(&out, h + kCheckpointHeaderSize);
+    char* q = reserve_output(&out, 2 * (size_t) p->num_cells +
+                                   4 * (size_t) pos->path_len);
+    for (int i = 0; i < p->num_cells; i++, q += 2)
+        store_le(q, p->cells[0][i], 2);
+    for (int i = 0; i < pos->path_len; i++, q += 4)
+        store_le(q, pos->path[i], 4);
+    commit_output(&out, q);
+    free_output(&out);
+    if (fsync(fd) < 0 || close(fd) < 0)
+        fatal("cannot write %s: %s", tmp_path, strerror(errno));
+    if (rename(tmp_path, path) < 0)
+        fatal("cannot rename %s: %s", tmp_path, strerror(errno));
+    free(tmp_path);
+}
+
+// Reads the position saved in the checkpoint file at path into pos, which
+// must have been saved from the search for p, with the same kind of matrix.
+static void load_checkpoint(const char* path, const Puzzle* p, bool pruned,
+                            DLXPosition* pos) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        fatal("cannot open %s: %s", path, strerror(errno));
+    size_t len;
+    char* data = read_whole_file(fd, path, &len);
+    if (len < kCheckpointHeaderSize ||
+        memcmp(data, kCheckpointMagic, sizeof(kCheckpointMagic)) != 0 ||
+        load_le(data + 4, 4) != (uint64_t) kCheckpointVersion)
+        fatal("%s is not a checkpoint file", path);
+    uint64_t path_len = load_le(data + 12, 4);
+    if (path_len < 1 || path_len > (uint64_t) p->num_cells ||
+        len != kCheckpointHeaderSize + 2 * (size_t) p->num_cells +
+               4 * path_len)
+        fatal("%s is corrupt", path);
+    const char* q = data + kCheckpointHeaderSize;
+    bool match = load_le(data + 8, 2) == (uint64_t) p->size;
+    for (int i = 0; match && i < p->num_cells; i++, q += 2)
+        match = load_le(q, 2) == (uint64_t) p->cells[0][i];
+    if (!match)
+        fatal("%s was saved from a different puzzle", path);
+    if (load_le(data + 10, 1) != (uint64_t) pruned)
+        fatal("%s was saved with a different --matrix", path);
+
+    // Each offset must be to one of the rows' nodes.
+    uint64_t num_row_nodes = 4 * (uint64_t) p->num_cells * p->size;
+    pos->path = xmalloc(sizeof(uint32_t) * path_len);
+    pos->path_len = path_len;
+    pos->num_solutions = load_le(data + 16, 8);
+    for (int i = 0; i < pos->path_len; i++, q += 4) {
+        pos->path[i] = load_le(q, 4);
+        if (pos->path[i] >= num_row_nodes)
+            fatal("%s is corrupt", path);
     }
+    free(data);
 }
 
-static void uncover_column(DLXObject* c) {
-    for (DLXObject* i = c->up; i != c; i = i->up) {
-        for (DLXObject* j = i->left; j != i; j = j->left) {
-            get_column_data(j->column)->row_count++;
-            j->down->up = j;
-            j->up->down = j;
+static void print_usage(void) {
+    printf(
+"usage: sudoku [OPTIONS] PUZZLE_FILE\n"
+"       sudoku [OPTIONS] --serve=ADDRESS\n"
+"       sudoku [OPTIONS] --generate=SIZE\n"
+"\n"
+"If PUZZLE_FILE is -, the puzzle is read from standard input. A 4x4 or 9x9\n"
+"puzzle may also be written on one line of 16 or 81 characters, using . or 0\n"
+"for empty cells.\n"
+"\n"
+"A puzzle preceded by the word diagonal must also have every value once on\n"
+"each main diagonal. One preceded by jigsaw has irregular regions in place\n"
+"of the boxes: its cells are followed by the region of each, from 1 to the\n"
+"puzzle's size, which for a 4x4 or 9x9 puzzle may be written as one field of\n"
+"16 or 81 digits. Variants are solved with dlx, and are never cached.\n"
+"\n"
+"Options:\n"
+"  -b    read any number of puzzles from PUZZLE_FILE and solve each in turn\n"
+"  -j N  use N threads, either to solve several puzzles at once (with -b)\n"
+"        or to split up the search for a single puzzle\n"
+"  --split-depth=D\n"
+"        with -j but not -b, split the search into the subtrees at depth D\n"
+"  --engine=ENGINE\n"
+"        search with ENGINE: dlx, bitboard (for puzzles up to 25x25 that are\n"
+"        not variants; others use dlx), or auto (the default, which is\n"
+"        bitboard wherever it can be). Splitting up the search with -j always\n"
+"        uses dlx.\n"
+"  --chooser=CHOOSER\n"
+"        pick the column for dlx to branch on by scanning every column (scan,\n"
+"        the default) or from buckets kept by number of rows (buckets). Both\n"
+"        pick the same column, so they only differ in speed.\n"
+"  --matrix=MATRIX\n"
+"        have dlx search a copy of the matrix for the puzzle's size, with a\n"
+"        row for every value in every cell (full), or a matrix built for the\n"
+"        puzzle with only the rows that its givens leave possible (pruned).\n"
+"        auto, the default, prunes from 64x64 up, where the full matrix takes\n"
+"        from tens of megabytes to gigabytes.\n"
+"  -n    print only the number of solutions found\n"
+"  -l    print each solution on one line, in a form that can be read back in\n"
+"  -P    write the solutions in the packed binary format, in which a puzzle\n"
+"        with no solutions gets a record with every cell empty. Packed input\n"
+"        is recognised automatically.\n"
+"  --convert\n"
+"        print the puzzles themselves rather than their solutions, in the\n"
+"        format chosen by -l or -P\n"
+"  --serve=ADDRESS\n"
+"        answer requests on ADDRESS (unix:PATH or [HOST:]PORT) until killed,\n"
+"        using -j threads. A request is a puzzle prefixed by its length as a\n"
+"        4-byte big-endian number. The reply is its length in the same way,\n"
+"        then a status byte (0 for success, 1 for an error, or 2 if the\n"
+"        search ran out of time), the number of solutions as an 8-byte\n"
+"        big-endian number, and the output.\n"
+"  --cache=MIB\n"
+"        remember the results of up to MIB megabytes of puzzles (by default\n"
+"        64), so that a puzzle that matches an earlier one up to relabelling\n"
+"        the values, transposing, or reordering the bands, the stacks and the\n"
+"        lines within them is usually not solved again. Not used when -j\n"
+"        splits the search for a single puzzle.\n"
+"  --cache-file=PATH\n"
+"        keep the cache in PATH from one run to the next\n"
+"  --stats\n"
+"        for each puzzle, print a line of search statistics to standard\n"
+"        error as a JSON object: the branches tried (nodes) and how many\n"
+"        were dead ends (backtracks), the deepest level reached, the columns\n"
+"        that dlx covered and the links those removed, and the microseconds\n"
+"        spent getting the matrix or bitboard ready and searching. Solving\n"
+"        without --stats counts nothing, and is no slower for it.\n"
+"  --skip=K, --count=N\n"
+"        with -b, skip the first K puzzles, then solve at most N\n"
+"  --shard-depth=D\n"
+"        rather than solving each puzzle, print the subproblems that its\n"
+"        search splits into at depth D, as puzzles in the format chosen by\n"
+"        -l or -P. Each is the puzzle with a few more cells filled in, and\n"
+"        each of the puzzle's solutions is a solution of exactly one of\n"
+"        them, so they can be counted separately with -n, wherever is\n"
+"        convenient.\n"
+"  --sum\n"
+"        print the total of the numbers in PUZZLE_FILE, such as the counts\n"
+"        that -n printed for each of a puzzle's subproblems\n"
+"  --exact-cover\n"
+"        solve the exact cover problem in PUZZLE_FILE instead of a puzzle.\n"
+"        Its first line names the columns, separated by spaces, with those\n"
+"        after a lone | being secondary: covered at most once rather than\n"
+"        exactly once. Each line after that is a row, listing the columns it\n"
+"        covers, or a comment if it starts with |. Each solution is printed\n"
+"        as the numbers of its rows (counting from 1) in order on one line.\n"
+"        Works with -j, -n, --max-solutions, --unique, --chooser, --stats and\n"
+"        --timeout.\n"
+"  --generate=SIZE\n"
+"        rather than reading any puzzles, make --count of them (by default\n"
+"        1) that are SIZE x SIZE (at most 16x16), and print them in the\n"
+"        format chosen by -l or -P. Each has exactly one solution, and would\n"
+"        have more without any one of its givens. With -j, they are made on\n"
+"        that many threads.\n"
+"        --skip=K leaves out the first K that the seed would make.\n"
+"  --seed=SEED\n"
+"        with --generate, make the same puzzles as any other run with SEED,\n"
+"        whatever -j is. By default, the seed differs from run to run.\n"
+"  --timeout=SECONDS\n"
+"        stop searching each puzzle after SECONDS (which may be fractional),\n"
+"        keeping the solutions found so far. If any puzzle's search is\n"
+"        stopped, the exit status is 4.\n"
+"  --checkpoint=FILE\n"
+"        if the search is stopped, by --timeout or SIGINT or SIGTERM, save\n"
+"        where it got to in FILE. Once a search finishes, FILE is removed.\n"
+"        Only for a single puzzle, without -j, and solved with dlx.\n"
+"  --resume=FILE\n"
+"        carry on the search saved in FILE, which must be for the same\n"
+"        puzzle, counting the solutions found before it was stopped. FILE\n"
+"        may also be the --checkpoint file.\n"
+"  --max-solutions=N\n"
+"        stop searching each puzzle once N solutions have been found\n"
+"  --unique\n"
+"        the same as --max-solutions=2, but also exit with status 0 if every\n"
+"        puzzle has exactly one solution. Otherwise, the status is 3 if some\n"
+"        puzzle has more than one, or else 2.\n"
+"  -h    show this message and exit\n");
+}
+
+// Solves every puzzle in r, sharing them out among config->num_threads
+// worker threads, and prints the results to out. For --generate, r is NULL,
+// and the workers make config->count puzzles instead.
+static void solve_batch(const ProgramConfig* config, const char* path,
+                        PuzzleReader* r, OutputBuffer* out, PackedOutput* po,
+                        int* status) {
+    int num_workers = config->num_threads;
+    BatchWorker* workers = xmalloc(sizeof(BatchWorker) * num_workers);
+    for (int i = 0; i < num_workers; i++) {
+        init_solver(&workers[i].ctx, config);
+        init_output(&workers[i].output, -1);
+        workers[i].ctx.out = &workers[i].output;
+    }
+
+    BatchQueue q;
+    int max_jobs = num_workers * kJobsPerWorker;
+    q.jobs = xmalloc(sizeof(BatchJob) * max_jobs);
+    init_arena(&q.arena);
+    q.num_jobs = 0;
+    uint64_t index = 0;
+    for (;;) {
+        int ret = 1;
+        Puzzle* p = &q.jobs[q.num_jobs].puzzle;
+        if (index + q.num_jobs < config->count && config->generate) {
+            init_puzzle(p, config->generate, &q.arena);
+            memset(p->cells[0], 0, sizeof(int) * p->num_cells);
+            ret = 0;
+        } else if (index + q.num_jobs < config->count) {
+            ret = read_puzzle(p, r, &q.arena);
+        }
+        if (ret < 0 || (ret > 0 && index + q.num_jobs == 0 &&
+                        config->skip == 0)) {
+            flush_output(out);
+            read_error(path, r, true, config->skip + index + q.num_jobs);
         }
+        if (ret == 0) {
+            if (config->packed)
+                start_packed_puzzle(po, out, p);
+            q.num_jobs++;
+        }
+        if (q.num_jobs == max_jobs || (ret > 0 && q.num_jobs > 0)) {
+            run_batch_jobs(&q, workers, num_workers, index, out, status);
+            index += q.num_jobs;
+            q.num_jobs = 0;
+        }
+        if (ret > 0)
+            break;
     }
-    c->right->left = c;
-    c->left->right = c;
+
+    free(q.jobs);
+    free_arena(&q.arena);
+    for (int i = 0; i < num_workers; i++) {
+        destroy_solver(&workers[i].ctx);
+        free_output(&workers[i].output);
+    }
+    free(workers);
 }
 
-static void dlx_solve(void) {
-    DLXObject* h = dlx_params.header;
-    if (h->right == h) {
-        // Found a solution.
-        if (config.print_solutions) {
-            if (dlx_params.num_solutions > 0)
-                printf("\n");
-            print_puzzle(dlx_params.solution, dlx_params.init);
-        }
-        dlx_params.num_solutions++;
-        return;
+#ifdef HAVE_EPOLL
+// Fills in a reader for the n bytes at data, as if they had been mapped in.
+static void init_memory_reader(PuzzleReader* r, const char* data, size_t n) {
+    *r = (PuzzleReader) { .fd = -1, .buf = (char*) data, .len = n,
+                          .eof = true };
+}
+
+static inline void store_be32(char* p, uint32_t x) {
+    for (int i = 3; i >= 0; i--, x >>= 8)
+        p[i] = x;
+}
+
+static inline uint32_t load_be32(const char* p) {
+    uint32_t x = 0;
+    for (int i = 0; i < 4; i++)
+        x = x << 8 | (uint8_t) p[i];
+    return x;
+}
+
+// Starts reply with its frame header, to be finished by end_reply().
+static void start_reply(OutputBuffer* reply, int status,
+                        uint64_t num_solutions) {
+    char* p = reserve_output(reply, kServeReplyHeaderSize);
+    p[4] = status;
+    for (int i = 12; i >= 5; i--, num_solutions >>= 8)
+        p[i] = num_solutions;
+    commit_output(reply, p + kServeReplyHeaderSize);
+}
+
+// Fills in the length of the reply that starts at offset start in reply.
+static void end_reply(OutputBuffer* reply, size_t start) {
+    store_be32(reply->data + start, reply->len - start - 4);
+}
+
+static void solve_request(ServeWorker* w, ServeJob* job) {
+    SolverContext* ctx = &w->ctx;
+    PuzzleReader r;
+    init_memory_reader(&r, job->request, job->request_len);
+    Puzzle p;
+    init_output(&job->reply, -1);
+    if (read_puzzle(&p, &r, &ctx->arena) != 0 || !at_end_of_input(&r)) {
+        static const char kError[] = "error: incorrect puzzle format\n";
+        start_reply(&job->reply, kServeStatusError, 0);
+        append_output(&job->reply, kError, sizeof(kError) - 1);
+    } else {
+        uint64_t num_solutions = solve_puzzle(ctx, &p);
+        start_reply(&job->reply, ctx->interrupted ? kServeStatusStopped :
+                                                     kServeStatusOk,
+                    num_solutions);
+        append_output(&job->reply, w->output.data, w->output.len);
+        w->output.len = 0;
+    }
+    end_reply(&job->reply, 0);
+    reset_arena(&ctx->arena);
+}
+
+static void* serve_worker_main(void* arg) {
+    ServeWorker* w = arg;
+    ServeServer* s = w->server;
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (!s->jobs_head)
+            pthread_cond_wait(&s->job_ready, &s->lock);
+        ServeJob* job = s->jobs_head;
+        s->jobs_head = job->next;
+        pthread_mutex_unlock(&s->lock);
+
+        solve_request(w, job);
+
+        pthread_mutex_lock(&s->lock);
+        job->next = s->done;
+        s->done = job;
+        pthread_mutex_unlock(&s->lock);
+        uint64_t one = 1;
+        if (write(s->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            fatal("cannot wake up the event loop: %s", strerror(errno));
     }
+    return NULL;
+}
 
-    DLXObject* c = h;
-    int min_row_count = dlx_params.solution->size + 1;
-    for (DLXObject* j = h->right; j != h; j = j->right) {
-        int row_count = get_column_data(j)->row_count;
-        if (row_count < min_row_count) {
-            c = j;
-            min_row_count = row_count;
+static void free_conn(ServeConn* c) {
+    free(c->in);
+    free(c->out.data);
+    free(c);
+}
+
+// Queues c to be freed, once nothing refers to it any more.
+static void release_conn(ServeServer* s, ServeConn* c) {
+    c->next_closed = s->closed;
+    s->closed = c;
+}
+
+static void close_conn(ServeServer* s, ServeConn* c) {
+    close(c->fd);
+    c->closed = true;
+    if (!c->busy)
+        release_conn(s, c);
+}
+
+// Waits for the socket to be readable until the client has finished sending,
+// and writable while there is output pending. Once the client has finished,
+// its socket would be reported readable (or hung up) on every pass, so it
+// is left out of the epoll set while there is nothing to send.
+static void update_conn_events(ServeServer* s, ServeConn* c) {
+    uint32_t events = (c->eof ? 0 : EPOLLIN) | (c->out.len > 0 ? EPOLLOUT : 0);
+    if (c->events == events)
+        return;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    int op = events == 0 ? EPOLL_CTL_DEL :
+             c->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(s->epoll_fd, op, c->fd, &ev) < 0)
+        fatal("epoll_ctl: %s", strerror(errno));
+    c->events = events;
+}
+
+// Sends as much of c's pending output as the socket will take. Returns false
+// if the connection was closed.
+static bool write_conn(ServeServer* s, ServeConn* c) {
+    while (c->out_pos < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->out_pos,
+                         c->out.len - c->out_pos, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0) {
+            close_conn(s, c);
+            return false;
         }
+        c->out_pos += n;
     }
-    cover_column(c);
-    for (DLXObject* r = c->down; r != c; r = r->down) {
-        // Record this value in the solution puzzle.
-        DLXRowData row_data = *(DLXRowData*) r->data;
-        dlx_params.solution->cells[row_data.row][row_data.column] =
-            row_data.value;
-
-        for (DLXObject* j = r->right; j != r; j = j->right)
-            cover_column(j->column);
-        dlx_solve();
-
-        for (DLXObject* j = r->left; j != r; j = j->left)
-            uncover_column(j->column);
-    }
-    uncover_column(c);
-}
-
-static void solve_puzzle(Puzzle* p) {
-    // Manufacture a DLX structure for solving p, then call dlx_solve().
-    int puzzle_size = p->size;
-    int num_cells = p->num_cells;
-    int num_constraints = 4 * num_cells;
-    int num_choices = num_cells * puzzle_size;
-
-    // Allocate all DLXObjects at once, then link them together below.
-    DLXObject* header = xmalloc(sizeof(DLXObject) *
-            (num_choices * 4 + num_constraints + 1));
-
-    // Link up the column headers (which correspond to constraints).
-    DLXObject* last_constraint = header + num_constraints;
-    header->left = last_constraint;
-    header->right = header + 1;
-    DLXColumnData* col_data = xmalloc(sizeof(DLXColumnData) * num_constraints);
-    // Keep a list of the bottom-most object in each column.
-    DLXObject** object_cols = xmalloc(sizeof(DLXObject*) * num_constraints);
-    for (int i = 0; i < num_constraints; i++) {
-        DLXObject* c = header + 1 + i;
-        c->left = c - 1;
-        c->right = c + 1;
-        c->column = c;
-        c->data = &col_data[i];
-        col_data[i].row_count = puzzle_size;
-        object_cols[i] = c;
-    }
-    last_constraint->right = header;
-
-    // Link up the row objects.
-    DLXObject* obj = last_constraint + 1;
-    DLXRowData* row_data_start = xmalloc(sizeof(DLXRowData) * num_choices);
-    DLXRowData* row_data = row_data_start;
-    int block_size = sqrt(puzzle_size);
-    for (int r = 0; r < puzzle_size; r++) {
-        for (int c = 0; c < puzzle_size; c++) {
-            int block_index = r - r % block_size + c / block_size;
-            for (int v = 1; v < puzzle_size + 1; v++) {
-                DLXRowData* data = row_data++;
-                data->row = r;
-                data->column = c;
-                data->value = v;
-
-                DLXObject* start = obj;
-                // Calculate the index (i.e. distance from header) of the four
-                // constraint columns corresponding to this (row, col, value)
-                // triple.
-                int constraint_indices[4] = {
-                    puzzle_size * r + c,               // row-column
-                    puzzle_size * r + v - 1,           // row-value
-                    puzzle_size * c + v - 1,           // column-value
-                    puzzle_size * block_index + v - 1  // block-value
-                };
-                for (int i = 0; i < 4; i++) {
-                    int idx = i * num_cells + constraint_indices[i];
-                    DLXObject* obj_above = object_cols[idx];
-                    obj->up = obj_above;
-                    obj->left = obj - 1;
-                    obj->right = obj + 1;
-                    obj->column = header + 1 + idx;
-                    obj->data = data;
-                    obj_above->down = obj;
-                    object_cols[idx] = obj;
-                    obj++;
-                }
-                start->left = obj - 1;
-                (obj - 1)->right = start;
-            }
+    if (c->out_pos == c->out.len)
+        c->out_pos = c->out.len = 0;
+    update_conn_events(s, c);
+    // Once the client has stopped sending, close the connection when
+    // everything it asked for has been sent.
+    if (c->eof && !c->busy && c->out.len == 0) {
+        close_conn(s, c);
+        return false;
+    }
+    return true;
+}
+
+// Hands c's next request to the workers, if there is a whole one waiting and
+// none being solved already. Returns false if the connection was closed.
+static bool dispatch_request(ServeServer* s, ServeConn* c) {
+    if (c->busy || c->in_len < 4)
+        return true;
+    uint32_t len = load_be32(c->in);
+    if (len > kMaxServeRequestSize) {
+        // There is no telling where the next request would start, so give
+        // up on the connection after saying why.
+        static const char kError[] = "error: request too large\n";
+        size_t start = c->out.len;
+        start_reply(&c->out, kServeStatusError, 0);
+        append_output(&c->out, kError, sizeof(kError) - 1);
+        end_reply(&c->out, start);
+        c->eof = true;
+        c->in_len = 0;
+        return write_conn(s, c);
+    }
+    if (c->in_len - 4 < len)
+        return true;
+
+    ServeJob* job = xmalloc(sizeof(ServeJob));
+    job->conn = c;
+    job->request = xmalloc(len + 1);
+    memcpy(job->request, c->in + 4, len);
+    job->request_len = len;
+    job->next = NULL;
+    c->in_len -= 4 + len;
+    memmove(c->in, c->in + 4 + len, c->in_len);
+    c->busy = true;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->jobs_head)
+        s->jobs_tail->next = job;
+    else
+        s->jobs_head = job;
+    s->jobs_tail = job;
+    pthread_cond_signal(&s->job_ready);
+    pthread_mutex_unlock(&s->lock);
+    return true;
+}
+
+static void read_conn(ServeServer* s, ServeConn* c) {
+    for (;;) {
+        if (c->in_size - c->in_len < kReadBlockSize) {
+            c->in_size = c->in_size ? 2 * c->in_size : 2 * kReadBlockSize;
+            c->in = realloc(c->in, c->in_size);
+            if (!c->in)
+                fatal("out of memory");
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            c->eof = true;
+            break;
+        }
+        c->in_len += n;
+        // Don't let a client that never waits for its replies pile up
+        // requests without limit.
+        if (c->in_len > 2 * (4 + (size_t) kMaxServeRequestSize)) {
+            close_conn(s, c);
+            return;
         }
     }
-    for (int i = 0; i < num_constraints; i++) {
-        DLXObject* o = object_cols[i];
-        o->down = o->column;
-        o->column->up = o;
+    if (dispatch_request(s, c))
+        write_conn(s, c);
+}
+
+// Queues up the replies of the jobs that the workers have finished.
+static void finish_jobs(ServeServer* s) {
+    uint64_t count;
+    if (read(s->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fatal("cannot read from eventfd: %s", strerror(errno));
+    pthread_mutex_lock(&s->lock);
+    ServeJob* jobs = s->done;
+    s->done = NULL;
+    pthread_mutex_unlock(&s->lock);
+
+    while (jobs) {
+        ServeJob* job = jobs;
+        jobs = job->next;
+        ServeConn* c = job->conn;
+        c->busy = false;
+        if (c->closed) {
+            release_conn(s, c);
+        } else {
+            append_output(&c->out, job->reply.data, job->reply.len);
+            if (dispatch_request(s, c))
+                write_conn(s, c);
+        }
+        free(job->reply.data);
+        free(job->request);
+        free(job);
     }
-    free(object_cols);
+    if (s->config->cache)
+        flush_cache(s->config->cache);
+}
 
-    // Prepare the DLX structure according to our puzzle's initial values.
-    for (int r = 0; r < puzzle_size; r++) {
-        for (int c = 0; c < puzzle_size; c++) {
-            int v = p->cells[r][c];
-            if (v != 0) {
-                DLXObject* dlx_row = last_constraint + 1 +
-                        4 * (num_cells * r + puzzle_size * c + v - 1);
+static void accept_conns(ServeServer* s) {
+    for (;;) {
+        int fd = accept4(s->listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // Running out of file descriptors leaves the client waiting in
+            // the backlog until a connection closes.
+            return;
+        }
+        ServeConn* c = xmalloc(sizeof(ServeConn));
+        *c = (ServeConn) { .fd = fd, .events = EPOLLIN };
+        init_output(&c->out, -1);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            fatal("epoll_ctl: %s", strerror(errno));
+    }
+}
 
-                cover_column(dlx_row->column);
-                for (DLXObject* o = dlx_row->right; o != dlx_row; o = o->right)
-                    cover_column(o->column);
-            }
+// Creates a socket listening on address, which is either unix:PATH or
+// [HOST:]PORT.
+static int listen_on(const char* address) {
+    int fd;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        const char* path = address + 5;
+        if (*path == '\0' || strlen(path) >= sizeof(sun.sun_path))
+            fatal("invalid socket path: %s", path);
+        strcpy(sun.sun_path, path);
+        // Replace a socket left behind by an earlier server, but nothing
+        // else.
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*) &sun, sizeof(sun)) < 0)
+            fatal("cannot listen on %s: %s", address, strerror(errno));
+    } else {
+        char host[256] = "";
+        const char* port = strrchr(address, ':');
+        if (port) {
+            size_t host_len = port - address;
+            if (host_len >= sizeof(host))
+                fatal("invalid address: %s", address);
+            memcpy(host, address, host_len);
+            host[host_len] = '\0';
+            port++;
+        } else {
+            port = address;
         }
+        struct addrinfo hints = {
+            .ai_family = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM,
+            .ai_flags = AI_PASSIVE
+        };
+        struct addrinfo* ai;
+        int err = getaddrinfo(*host ? host : NULL, port, &hints, &ai);
+        if (err != 0)
+            fatal("cannot listen on %s: %s", address, gai_strerror(err));
+        fd = socket(ai->ai_family,
+                    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        int one = 1;
+        if (fd < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            bind(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+            fatal("cannot listen on %s: %s", address, strerror(errno));
+        freeaddrinfo(ai);
     }
+    if (listen(fd, SOMAXCONN) < 0)
+        fatal("cannot listen on %s: %s", address, strerror(errno));
+    return fd;
+}
 
-    Puzzle solution;
-    copy_puzzle(&solution, p);
-    dlx_params = (DLXParameters) {
-        .header = header,
-        .init = p,
-        .solution = &solution,
-        .num_solutions = 0
+// Answers requests on address until killed, with config->num_threads
+// workers. Each request is a puzzle in any format that read_puzzle()
+// accepts, sent as a 4-byte big-endian length followed by that many bytes.
+// Each reply is a 4-byte big-endian length, followed by a status byte
+// (kServeStatusOk, kServeStatusError or kServeStatusStopped), the number of
+// solutions as an 8-byte big-endian integer, and then the output that solving
+// the puzzle would have printed.
+static void serve(const ProgramConfig* config, const char* address) {
+    ServeServer s = {
+        .config = config,
+        .listen_fd = listen_on(address),
+        .jobs_head = NULL,
+        .done = NULL
     };
-    dlx_solve();
+    s.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    s.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s.epoll_fd < 0 || s.wake_fd < 0)
+        fatal("cannot start the event loop: %s", strerror(errno));
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.job_ready, NULL);
+    // The listening socket and the eventfd are told apart from connections
+    // by their data pointers.
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &s.listen_fd };
+    if (epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, s.listen_fd, &ev) < 0)
+        fatal("epoll_ctl: %s", strerror(errno));
+    ev.data.ptr = &s.wake_fd;
+    if (epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, s.wake_fd, &ev) < 0)
+        fatal("epoll_ctl: %s", strerror(errno));
 
-    if (config.print_num_solutions)
-        printf("%" PRIu64 "\n", dlx_params.num_solutions);
-    else if (dlx_params.num_solutions == 0)
-        printf("The puzzle has no solutions.\n");
+    // The workers' matrices are built on first use and kept from then on.
+    int num_workers = config->num_threads;
+    ServeWorker* workers = xmalloc(sizeof(ServeWorker) * num_workers);
+    for (int i = 0; i < num_workers; i++) {
+        ServeWorker* w = &workers[i];
+        init_solver(&w->ctx, config);
+        init_output(&w->output, -1);
+        w->ctx.out = &w->output;
+        w->server = &s;
+        int err = pthread_create(&w->thread, NULL, serve_worker_main, w);
+        if (err != 0)
+            fatal("cannot create thread: %s", strerror(err));
+    }
 
-    free_puzzle(&solution);
-    free(row_data_start);
-    free(col_data);
-    free(header);
+    struct epoll_event events[64];
+    for (;;) {
+        int n = epoll_wait(s.epoll_fd, events, 64, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            fatal("epoll_wait: %s", strerror(errno));
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &s.listen_fd) {
+                accept_conns(&s);
+            } else if (ptr == &s.wake_fd) {
+                finish_jobs(&s);
+            } else {
+                ServeConn* c = ptr;
+                // An earlier event in this batch may have closed it.
+                if (c->closed)
+                    continue;
+                if (events[i].events & EPOLLOUT) {
+                    if (!write_conn(&s, c))
+                        continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    read_conn(&s, c);
+            }
+        }
+        while (s.closed) {
+            ServeConn* c = s.closed;
+            s.closed = c->next_closed;
+            free_conn(c);
+        }
+    }
 }
+#endif
 
-static void print_usage(void) {
-    printf(
-"usage: sudoku [OPTIONS] PUZZLE_FILE\n"
-"\n"
-"Options:\n"
-"  -n    print only the number of solutions found\n"
-"  -h    show this message and exit\n");
+// Set by SIGINT or SIGTERM with --checkpoint, to make the search stop and be
+// saved.
+static volatile sig_atomic_t cancel_requested;
+
+static void handle_cancel_signal(int sig) {
+    (void) sig;
+    cancel_requested = 1;
 }
 
 int main(int argc, char** argv) {
+    ProgramConfig config = {
+        .print_solutions = true,
+        .print_num_solutions = false,
+        .batch = false,
+        .engine = ENGINE_AUTO,
+        .chooser = CHOOSER_SCAN,
+        .matrix = MATRIX_AUTO,
+        .num_threads = 1,
+        .split_depth = 0,
+        .max_solutions = UINT64_MAX,
+        .unique = false,
+        .one_line = false,
+        .highlight = isatty(STDOUT_FILENO),
+        .packed = false,
+        .skip = 0,
+        .count = UINT64_MAX,
+        .convert = false,
+        .cache = NULL,
+        .stats = false,
+        .timeout = 0,
+        .checkpoint_path = NULL,
+        .resume_path = NULL,
+        .shard_depth = 0,
+        .exact_cover = false,
+        .generate = 0,
+        // Different from one run to the next, unless --seed is given.
+        .seed = mix_bits((uint64_t) time(NULL) << 32 ^ getpid())
+    };
+    bool sum = false;
+    const char* serve_address = NULL;
+    uint64_t cache_size = 0;
+    const char* cache_path = NULL;
     static const struct option long_options[] = {
+        { "batch", no_argument, NULL, 'b' },
+        { "jobs", required_argument, NULL, 'j' },
         { "number-only", no_argument, NULL, 'n' },
+        { "one-line", no_argument, NULL, 'l' },
+        { "split-depth", required_argument, NULL, 'S' },
+        { "engine", required_argument, NULL, 'e' },
+        { "chooser", required_argument, NULL, 'o' },
+        { "matrix", required_argument, NULL, 'M' },
+        { "max-solutions", required_argument, NULL, 'm' },
+        { "unique", no_argument, NULL, 'u' },
+        { "packed", no_argument, NULL, 'P' },
+        { "skip", required_argument, NULL, 'K' },
+        { "count", required_argument, NULL, 'N' },
+        { "convert", no_argument, NULL, 'C' },
+        { "serve", required_argument, NULL, 's' },
+        { "cache", required_argument, NULL, 'c' },
+        { "cache-file", required_argument, NULL, 'F' },
+        { "stats", no_argument, NULL, 'T' },
+        { "timeout", required_argument, NULL, 't' },
+        { "checkpoint", required_argument, NULL, 'k' },
+        { "resume", required_argument, NULL, 'r' },
+        { "shard-depth", required_argument, NULL, 'D' },
+        { "sum", no_argument, NULL, 'U' },
+        { "exact-cover", no_argument, NULL, 'X' },
+        { "generate", required_argument, NULL, 'g' },
+        { "seed", required_argument, NULL, 'G' },
         { "help", no_argument, NULL, 'h' },
         { NULL, 0, NULL, 0 }
     };
     for (;;) {
-        int c = getopt_long(argc, argv, "nh", long_options, NULL);
+        int c = getopt_long(argc, argv, "bj:nlPh", long_options, NULL);
         if (c == -1)
             break;
 
         switch (c) {
+        case 'b':
+            config.batch = true;
+            break;
+        case 'j': {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || n < 1 || n > kMaxThreads)
+                fatal("invalid number of threads: %s", optarg);
+            config.num_threads = n;
+            break;
+        }
+        case 'S': {
+            char* end;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || n < 1 ||
+                n > kMaxSplitDepth)
+                fatal("invalid split depth: %s", optarg);
+            config.split_depth = n;
+            break;
+        }
+        case 'e':
+            if (strcmp(optarg, "auto") == 0)
+                config.engine = ENGINE_AUTO;
+            else if (strcmp(optarg, "dlx") == 0)
+                config.engine = ENGINE_DLX;
+            else if (strcmp(optarg, "bitboard") == 0)
+                config.engine = ENGINE_BITBOARD;
+            else
+                fatal("unknown engine: %s", optarg);
+            break;
+        case 'o':
+            if (strcmp(optarg, "scan") == 0)
+                config.chooser = CHOOSER_SCAN;
+            else if (strcmp(optarg, "buckets") == 0)
+                config.chooser = CHOOSER_BUCKETS;
+            else
+                fatal("unknown column chooser: %s", optarg);
+            break;
+        case 'M':
+            if (strcmp(optarg, "auto") == 0)
+                config.matrix = MATRIX_AUTO;
+            else if (strcmp(optarg, "full") == 0)
+                config.matrix = MATRIX_FULL;
+            else if (strcmp(optarg, "pruned") == 0)
+                config.matrix = MATRIX_PRUNED;
+            else
+                fatal("unknown matrix: %s", optarg);
+            break;
+        case 'm':
+            config.max_solutions = parse_count(optarg, 1,
+                                               "number of solutions");
+            break;
+        case 'K':
+            config.skip = parse_count(optarg, 0, "number of puzzles");
+            break;
+        case 'N':
+            config.count = parse_count(optarg, 1, "number of puzzles");
+            break;
+        case 'P':
+            config.packed = true;
+            break;
+        case 'C':
+            config.convert = true;
+            break;
+        case 's':
+            serve_address = optarg;
+            break;
+        case 'c':
+            cache_size = parse_count(optarg, 1, "cache size");
+            if (cache_size > SIZE_MAX >> 20)
+                fatal("invalid cache size: %s", optarg);
+            break;
+        case 'F':
+            cache_path = optarg;
+            break;
+        case 'T':
+            config.stats = true;
+            break;
+        case 't': {
+            char* end;
+            errno = 0;
+            double t = strtod(optarg, &end);
+            if (!isdigit((unsigned char) *optarg) || *end != '\0' ||
+                !(t > 0) || errno == ERANGE)
+                fatal("invalid timeout: %s", optarg);
+            config.timeout = t;
+            break;
+        }
+        case 'k':
+            config.checkpoint_path = optarg;
+            break;
+        case 'r':
+            config.resume_path = optarg;
+            break;
+        case 'D': {
+            // No path is longer than the largest puzzle has cells.
+            uint64_t n = parse_count(optarg, 1, "shard depth");
+            uint64_t max = (uint64_t) kMaxPuzzleSize * kMaxPuzzleSize;
+            config.shard_depth = n < max ? n : max;
+            break;
+        }
+        case 'U':
+            sum = true;
+            break;
+        case 'X':
+            config.exact_cover = true;
+            break;
+        case 'g': {
+            uint64_t n = parse_count(optarg, 1, "puzzle size");
+            if (n > (uint64_t) kMaxPuzzleSize || !issquare(n))
+                fatal("invalid puzzle size: %s", optarg);
+            if (n > (uint64_t) kMaxGenerateSize)
+                fatal("--generate only makes puzzles up to %dx%d",
+                      kMaxGenerateSize, kMaxGenerateSize);
+            config.generate = n;
+            break;
+        }
+        case 'G':
+            config.seed = parse_count(optarg, 0, "seed");
+            break;
+        case 'u':
+            config.unique = true;
+            config.max_solutions = 2;
+            break;
         case 'n':
             config.print_num_solutions = true;
             config.print_solutions = false;
             break;
+        case 'l':
+            config.one_line = true;
+            break;
         case 'h':
             print_usage();
             return EXIT_SUCCESS;
@@ -403,23 +1368,216 @@ int main(int argc, char** argv) {
     }
     argv += optind;
     argc -= optind;
-    if (argc < 1)
+    int num_args = serve_address || config.generate ? 0 : 1;
+    if (argc < num_args)
         fatal("not enough arguments");
-    if (argc > 1)
+    if (argc > num_args)
         fatal("too many arguments");
+    if (config.packed && (config.print_num_solutions || config.one_line))
+        fatal("-P cannot be combined with -n or -l");
+    if ((config.skip > 0 || config.count != UINT64_MAX) && !config.batch &&
+        !config.generate)
+        fatal("--skip and --count need -b or --generate");
+    if (config.convert && config.print_num_solutions)
+        fatal("--convert cannot be combined with -n");
+    if (config.stats && serve_address)
+        fatal("--stats cannot be combined with --serve");
+    if ((config.checkpoint_path || config.resume_path) &&
+        (config.batch || config.num_threads > 1 || serve_address ||
+         cache_size > 0 || cache_path || config.convert))
+        fatal("--checkpoint and --resume cannot be combined with -b, -j, "
+              "--serve, --cache or --convert");
+    if ((config.checkpoint_path || config.resume_path) &&
+        config.engine == ENGINE_BITBOARD)
+        fatal("--checkpoint and --resume need the dlx engine");
+    if (config.shard_depth &&
+        (config.num_threads > 1 || config.print_num_solutions ||
+         config.convert || config.unique || serve_address || config.stats ||
+         config.checkpoint_path || config.resume_path))
+        fatal("--shard-depth cannot be combined with -j, -n, --convert, "
+              "--unique, --serve, --stats, --checkpoint or --resume");
+    if (sum && serve_address)
+        fatal("--sum cannot be combined with --serve");
+    if (config.exact_cover &&
+        (config.batch || config.packed || config.convert || serve_address ||
+         cache_size > 0 || cache_path || config.checkpoint_path ||
+         config.resume_path || config.shard_depth || sum ||
+         config.engine == ENGINE_BITBOARD))
+        fatal("--exact-cover cannot be combined with -b, -P, --convert, "
+              "--serve, --cache, --checkpoint, --resume, --shard-depth, "
+              "--sum or --engine=bitboard");
+    if (config.generate &&
+        (config.batch || config.print_num_solutions || config.convert ||
+         serve_address || cache_size > 0 || cache_path || config.stats ||
+         config.timeout > 0 || config.checkpoint_path ||
+         config.resume_path || config.shard_depth || sum ||
+         config.exact_cover || config.max_solutions != UINT64_MAX ||
+         config.engine == ENGINE_BITBOARD))
+        fatal("--generate cannot be combined with -b, -n, --convert, "
+              "--serve, --cache, --stats, --timeout, --checkpoint, --resume, "
+              "--shard-depth, --sum, --exact-cover, --unique, "
+              "--max-solutions or --engine=bitboard");
 
-    Puzzle p;
-    FILE* f = fopen(argv[0], "r");
-    if (!f)
-        fatal("cannot open %s: %s", argv[0], strerror(errno));
-    if (read_puzzle(&p, f) < 0) {
-        const char* error_str = ferror(f) ? strerror(errno) :
-            "incorrect puzzle format";
-        fatal("error reading %s: %s", argv[0], error_str);
+    ResultCache cache;
+    if (cache_size > 0 || cache_path) {
+        init_cache(&cache, (size_t) (cache_size ? cache_size :
+                                     kDefaultCacheSize) << 20);
+        if (cache_path)
+            load_cache(&cache, cache_path);
+        config.cache = &cache;
     }
 
-    solve_puzzle(&p);
-    free_puzzle(&p);
-    fclose(f);
-    return 0;
+    if (serve_address) {
+#ifdef HAVE_EPOLL
+        config.highlight = false;
+        serve(&config, serve_address);
+#else
+        fatal("--serve is not supported on this system");
+#endif
+    }
+
+    const char* path = argv[0];
+    if (sum) {
+        print_sum(path);
+        return EXIT_SUCCESS;
+    }
+    int status = EXIT_SUCCESS;
+    OutputBuffer out;
+    init_output(&out, STDOUT_FILENO);
+    if (config.exact_cover) {
+        DLXMatrix image;
+        read_cover_matrix(&image, path);
+        SolverContext ctx;
+        init_solver(&ctx, &config);
+        ctx.out = &out;
+        uint64_t num_solutions;
+        if (config.num_threads > 1)
+            num_solutions = solve_split(&config, &image, NULL, &out,
+                                        &ctx.stats, &ctx.interrupted);
+        else
+            num_solutions = solve_cover(&ctx, &image);
+        record_result(&config, &status, num_solutions, ctx.interrupted);
+        if (config.stats)
+            print_stats(&ctx.stats, 0, 0, num_solutions);
+        // The copies of the matrix point into it, so they go first.
+        destroy_solver(&ctx);
+        free_matrix_image(&image);
+        free_output(&out);
+        return status;
+    }
+    if (config.generate) {
+        // The puzzles are printed the way --convert prints them.
+        config.convert = true;
+        if (config.count == UINT64_MAX)
+            config.count = 1;
+        PackedOutput po = { .size = 0 };
+        solve_batch(&config, NULL, NULL, &out, &po, &status);
+        if (config.packed)
+            finish_packed_output(&po, &out);
+        free_output(&out);
+        free_matrix_images();
+        return status;
+    }
+    PuzzleReader r;
+    if (!open_reader(&r, path))
+        fatal("cannot open %s: %s", path, strerror(errno));
+
+    if (skip_puzzles(&r, config.skip) < 0)
+        read_error(path, &r, true, config.skip);
+
+    PackedOutput po = { .size = 0 };
+    if (config.batch && config.num_threads > 1) {
+        solve_batch(&config, path, &r, &out, &po, &status);
+    } else {
+        SolverContext ctx;
+        init_solver(&ctx, &config);
+        ctx.out = &out;
+        // A search that is saved can also be stopped by a signal.
+        DLXPosition resume, checkpoint = { .path_len = 0 };
+        if (config.checkpoint_path) {
+            struct sigaction sa = {
+                .sa_handler = handle_cancel_signal,
+                .sa_flags = SA_RESTART
+            };
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGINT, &sa, NULL);
+            sigaction(SIGTERM, &sa, NULL);
+            ctx.cancel = &cancel_requested;
+            ctx.checkpoint = &checkpoint;
+        }
+        Puzzle p;
+        for (uint64_t i = 0;; i++) {
+            int ret = i < config.count ? read_puzzle(&p, &r, &ctx.arena) : 1;
+            // Outside of batch mode, the puzzle must be the only thing in the
+            // file.
+            if (ret < 0 || (ret > 0 && i == 0 && config.skip == 0) ||
+                (ret == 0 && !config.batch && !at_end_of_input(&r))) {
+                flush_output(&out);
+                read_error(path, &r, config.batch, config.skip + i);
+            }
+            if (ret > 0)
+                break;
+
+            if (config.packed)
+                start_packed_puzzle(&po, &out, &p);
+            if (i > 0 && blank_line_between(&config))
+                append_output(&out, "\n", 1);
+            // A checkpoint has no room for a variant's rules.
+            if ((config.checkpoint_path || config.resume_path) &&
+                is_variant(&p))
+                fatal("--checkpoint and --resume cannot be used with "
+                      "variant puzzles");
+            if (config.resume_path) {
+                load_checkpoint(config.resume_path, &p,
+                                use_pruned_matrix(&config, &p), &resume);
+                ctx.resume = &resume;
+            }
+            uint64_t num_solutions;
+            if (config.shard_depth) {
+                num_solutions = write_shards(&ctx, &p);
+            } else if (!config.batch && config.num_threads > 1 &&
+                       !config.convert) {
+                DLXMatrix* own = has_own_matrix(&config, &p) ?
+                                 new_puzzle_image(&config, &p) : NULL;
+                const DLXMatrix* image = own ? own : get_matrix_image(p.size);
+                num_solutions = solve_split(&config, image, &p, &out,
+                                            &ctx.stats, &ctx.interrupted);
+                if (own)
+                    free_puzzle_image(own);
+            } else {
+                num_solutions = solve_puzzle(&ctx, &p);
+            }
+            record_result(&config, &status, num_solutions, ctx.interrupted);
+            if (config.checkpoint_path) {
+                // Leave a checkpoint only for a search that still has work
+                // left to do.
+                if (checkpoint.path_len > 0)
+                    write_checkpoint(config.checkpoint_path, &p,
+                                     use_pruned_matrix(&config, &p),
+                                     &checkpoint);
+                else if (unlink(config.checkpoint_path) < 0 &&
+                         errno != ENOENT)
+                    fatal("cannot remove %s: %s", config.checkpoint_path,
+                          strerror(errno));
+            }
+            if (config.resume_path)
+                free(resume.path);
+            free(checkpoint.path);
+            if (config.stats)
+                print_stats(&ctx.stats, config.skip + i, p.size,
+                            num_solutions);
+            reset_arena(&ctx.arena);
+            if (!config.batch)
+                break;
+        }
+        destroy_solver(&ctx);
+    }
+    if (config.packed)
+        finish_packed_output(&po, &out);
+    free_output(&out);
+    close_reader(&r);
+    if (config.cache)
+        free_cache(config.cache);
+    free_matrix_images();
+    return status;
 }
@@ -0,0 +1,195 @@
+// Copyright 2014 Philip Puryear
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The library's API (see sudokudlx.h), built on the solver in solver.c.
+#include <stdlib.h>
+#include <string.h>
+
+#include "solver.h"
+#include "sudokudlx.h"
+
+struct solver {
+    ProgramConfig config;
+    SolverContext ctx;
+    Puzzle puzzle, solution;
+};
+
+solver* solver_create(int size) {
+    if (size < 1 || size > kMaxPuzzleSize || !issquare(size))
+        return NULL;
+    solver* s = xmalloc(sizeof(solver));
+    s->config = (ProgramConfig) {
+        .engine = ENGINE_AUTO,
+        .chooser = CHOOSER_SCAN,
+        // Below kMinPrunedSize, a solver's matrix is built once and kept, so
+        // that solving allocates nothing; above it, the full matrix is too
+        // big to keep one per solver.
+        .matrix = MATRIX_AUTO,
+        .num_threads = 1,
+        .max_solutions = UINT64_MAX,
+        .count = UINT64_MAX
+    };
+    init_solver(&s->ctx, &s->config);
+    init_puzzle(&s->puzzle, size, &s->ctx.arena);
+    init_puzzle(&s->solution, size, &s->ctx.arena);
+    // Build whatever either engine needs now, so that solving allocates
+    // nothing.
+    if (size < kMinPrunedSize)
+        get_matrix(&s->ctx.matrices, size);
+    if (size <= kMaxBitboardSize)
+        get_bitboard(&s->ctx.bitboards, size);
+    return s;
+}
+
+int64_t solver_solve(solver* s, const int* cells, unsigned flags,
+                     solver_callback callback, void* data) {
+    if ((flags & ~(SOLVER_DLX | SOLVER_BITBOARD | SOLVER_BUCKETS)) ||
+        ((flags & SOLVER_DLX) && (flags & SOLVER_BITBOARD)))
+        return -1;
+    Puzzle* p = &s->puzzle;
+    for (int i = 0; i < p->num_cells; i++) {
+        if (cells[i] < 0 || cells[i] > p->size)
+            return -1;
+        p->cells[0][i] = cells[i];
+    }
+    s->config.engine = flags & SOLVER_DLX ? ENGINE_DLX :
+                       flags & SOLVER_BITBOARD ? ENGINE_BITBOARD :
+                       ENGINE_AUTO;
+    s->config.chooser = flags & SOLVER_BUCKETS ? CHOOSER_BUCKETS :
+                                                 CHOOSER_SCAN;
+
+    SolverContext* ctx = &s->ctx;
+    memcpy(s->solution.cells[0], p->cells[0], sizeof(int) * p->num_cells);
+    ctx->init = p;
+    ctx->solution = &s->solution;
+    ctx->num_solutions = 0;
+    ctx->stop = false;
+    ctx->callback = callback;
+    ctx->callback_data = data;
+    run_engine(ctx, p);
+    ctx->callback = NULL;
+    return ctx->num_solutions;
+}
+
+void solver_destroy(solver* s) {
+    if (!s)
+        return;
+    destroy_solver(&s->ctx);
+    free(s);
+}
+
+struct solver_session {
+    ProgramConfig config;
+    SolverContext ctx;
+    // The values placed so far, and the search's copy of them.
+    Puzzle puzzle, solution;
+    // The row of each value placed, in the order they were placed.
+    DLXNode* placed;
+    int num_placed;
+};
+
+solver_session* solver_session_create(int size) {
+    if (size < 1 || size > kMaxPuzzleSize || !issquare(size))
+        return NULL;
+    solver_session* s = xmalloc(sizeof(solver_session));
+    s->config = (ProgramConfig) {
+        .engine = ENGINE_DLX,
+        .chooser = CHOOSER_SCAN,
+        // A session's matrix is edited in place, so it needs every row.
+        .matrix = MATRIX_FULL,
+        .num_threads = 1,
+        .max_solutions = UINT64_MAX,
+        .count = UINT64_MAX
+    };
+    init_solver(&s->ctx, &s->config);
+    init_puzzle(&s->puzzle, size, &s->ctx.arena);
+    init_puzzle(&s->solution, size, &s->ctx.arena);
+    // A session's matrix is its own, and is never reset.
+    s->ctx.matrix = get_matrix(&s->ctx.matrices, size);
+    s->placed = xmalloc(sizeof(DLXNode) * s->solution.num_cells);
+    s->num_placed = 0;
+    return s;
+}
+
+// Returns the cell that row r of m places a value in.
+static int row_cell(const DLXMatrix* m, DLXNode r) {
+    return (r - m->first_row) / 4 / m->size;
+}
+
+int solver_session_place(solver_session* s, int cell, int value) {
+    DLXMatrix* m = s->ctx.matrix;
+    if (cell < 0 || cell >= s->solution.num_cells || value < 1 ||
+        value > m->size)
+        return -1;
+    DLXNode r = m->first_row + 4 * (m->size * cell + value - 1);
+    if (!is_row_free(m, r))
+        return 0;
+    cover_row(m, r);
+    s->placed[s->num_placed++] = r;
+    s->puzzle.cells[0][cell] = value;
+    s->solution.cells[0][cell] = value;
+    return 1;
+}
+
+int solver_session_remove(solver_session* s, int cell) {
+    DLXMatrix* m = s->ctx.matrix;
+    if (cell < 0 || cell >= s->solution.num_cells)
+        return -1;
+    if (s->puzzle.cells[0][cell] == 0)
+        return 0;
+    // Covers only come off in the reverse of the order they went on.
+    int i = s->num_placed;
+    do {
+        uncover_row(m, s->placed[--i]);
+    } while (row_cell(m, s->placed[i]) != cell);
+    s->num_placed--;
+    for (; i < s->num_placed; i++) {
+        s->placed[i] = s->placed[i + 1];
+        cover_row(m, s->placed[i]);
+    }
+    s->puzzle.cells[0][cell] = 0;
+    return 1;
+}
+
+int64_t solver_session_solve(solver_session* s, unsigned flags,
+                             uint64_t max_solutions,
+                             solver_callback callback, void* data) {
+    if (flags & ~SOLVER_BUCKETS)
+        return -1;
+    s->config.chooser = flags & SOLVER_BUCKETS ? CHOOSER_BUCKETS :
+                                                 CHOOSER_SCAN;
+    s->config.max_solutions = max_solutions ? max_solutions : UINT64_MAX;
+
+    // The search only writes the empty cells of the solution, and covers
+    // nothing that it does not uncover again, so the placed values and the
+    // matrix are left as the next solve needs them.
+    SolverContext* ctx = &s->ctx;
+    ctx->init = &s->puzzle;
+    ctx->solution = &s->solution;
+    ctx->num_solutions = 0;
+    ctx->stop = false;
+    ctx->callback = callback;
+    ctx->callback_data = data;
+    dlx_solve(ctx);
+    ctx->callback = NULL;
+    return ctx->num_solutions;
+}
+
+void solver_session_destroy(solver_session* s) {
+    if (!s)
+        return;
+    free(s->placed);
+    destroy_solver(&s->ctx);
+    free(s);
+}
@@ -0,0 +1,123 @@
+// Copyright 2014 Philip Puryear
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// libsudokudlx: the sudoku solver as a library.
+//
+// A solver is made for one puzzle size, and can then solve any number of
+// puzzles of that size without allocating any more memory, except from 64x64
+// up, where the full dlx matrix would take gigabytes: there each solve builds
+// a matrix of the rows that the puzzle's givens allow, and frees it after.
+// Solvers share nothing that is not safe to share, so any number of them can
+// be used at once from different threads, as long as each is used by one
+// thread at a time. The matrix that the dlx engine copies for each size is
+// built the first time it is needed, then kept until the process exits. Like
+// the command-line tool, the library exits the process if it runs out of
+// memory.
+
+#ifndef SUDOKUDLX_H
+#define SUDOKUDLX_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define SOLVER_API __attribute__((visibility("default")))
+#else
+#define SOLVER_API
+#endif
+
+typedef struct solver solver;
+
+// Flags for solver_solve().
+enum {
+    // Search with the dlx engine, or the bitboard engine. By default, the
+    // bitboard engine is used for puzzles up to 25x25, and dlx otherwise.
+    SOLVER_DLX = 1 << 0,
+    SOLVER_BITBOARD = 1 << 1,
+    // Have dlx pick the column to branch on from buckets kept by number of
+    // rows, rather than by scanning every column.
+    SOLVER_BUCKETS = 1 << 2
+};
+
+// What a callback returns: whether to carry on to the next solution.
+enum {
+    SOLVER_CONTINUE = 0,
+    SOLVER_STOP = 1
+};
+
+// Called with each solution found, as size * size values in row-major
+// order. The values are the search's own assignment rather than a copy, so
+// they must not be changed, and are only valid until the callback returns.
+// Any nonzero return is taken as SOLVER_STOP.
+typedef int (*solver_callback)(void* data, const int* cells);
+
+// Returns a solver for size x size puzzles, or NULL if size is not a square
+// number from 1 to 256.
+SOLVER_API solver* solver_create(int size);
+
+// Searches for every solution of the puzzle whose size * size cells are
+// given in row-major order, with 0 for an empty cell. Each solution is
+// passed to callback along with data, unless callback is NULL. Returns the
+// number of solutions found (up to the one at which callback stopped the
+// search), or -1 if a value is out of range or flags are invalid.
+SOLVER_API int64_t solver_solve(solver* s, const int* cells, unsigned flags,
+                                solver_callback callback, void* data);
+
+SOLVER_API void solver_destroy(solver* s);
+
+// A session keeps one puzzle's matrix alive between edits, for callers (such
+// as an editor checking each keystroke) that change a puzzle a cell at a time
+// and want to search it after each change. Placing a value covers its row,
+// and removing one uncovers the rows placed since, so an edit costs a few
+// link updates rather than setting up the whole puzzle again. Sessions are
+// used by one thread at a time, like solvers. A session's matrix has every
+// row, so big sizes take a lot of memory: the first 256x256 session takes
+// about 2.3 GB, counting the matrix kept for the size, and each one after
+// that about 1 GB more.
+typedef struct solver_session solver_session;
+
+// Returns an empty session for size x size puzzles, or NULL if size is not a
+// square number from 1 to 256.
+SOLVER_API solver_session* solver_session_create(int size);
+
+// Places value (from 1 to size) in the cell at row-major index cell. Returns
+// 1 if it was placed, 0 if it conflicts with a value already placed (the cell
+// itself included), in which case the session is unchanged, or -1 if cell or
+// value is out of range.
+SOLVER_API int solver_session_place(solver_session* s, int cell, int value);
+
+// Empties the cell at row-major index cell. Removing the value placed last is
+// cheapest; any other is found by undoing placements back to it, after which
+// the later ones are placed again. Returns 1 if the cell held a value, 0 if
+// it was empty, or -1 if cell is out of range.
+SOLVER_API int solver_session_remove(solver_session* s, int cell);
+
+// Searches for solutions of the values placed so far, with the dlx engine,
+// stopping at max_solutions of them (no limit if it is 0). flags may only be
+// 0 or SOLVER_BUCKETS. Callbacks and the return value are as for
+// solver_solve(). The session is left as it was found.
+SOLVER_API int64_t solver_session_solve(solver_session* s, unsigned flags,
+                                        uint64_t max_solutions,
+                                        solver_callback callback, void* data);
+
+SOLVER_API void solver_session_destroy(solver_session* s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif